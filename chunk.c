@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -9,12 +10,15 @@ void init_chunk(Chunk *chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   init_value_array(&chunk->constants);
+  chunk->cache_count = chunk->cache_capacity = 0;
+  chunk->caches = NULL;
 }
 
 void free_chunk(Chunk *chunk) {
   FREE_ARRAY(uint16_t, chunk->code, chunk->capacity);
   FREE_ARRAY(int, chunk->lines, chunk->capacity);
   free_value_array(&chunk->constants);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_capacity);
   init_chunk(chunk);
 }
 
@@ -30,15 +34,86 @@ void write_chunk(Chunk *chunk, const uint16_t byte, const int line) {
   chunk->lines[chunk->length++] = line;
 }
 
-int add_constant(Chunk *chunk, const Value value) {
-  const int ind = in_array(&chunk->constants, value);
-  if (ind != -1) return ind;
+#define CONSTANT_INDEX_MAX_LOAD 0.5
+
+void init_constant_index(ConstantIndex *index) {
+  index->count = index->capacity = 0;
+  index->slots = NULL;
+}
+
+void free_constant_index(ConstantIndex *index) {
+  FREE_ARRAY(int, index->slots, index->capacity);
+  init_constant_index(index);
+}
+
+// Equal values by values_equal() have the same bits here: 0 and -0 are one number.
+// NaN is never equal to anything, so it only gets a slot no lookup stops at
+static uint64_t constant_bits(const Value value) {
+  if (IS_NUMBER(value)) {
+    const double number = AS_NUMBER(value) == 0 ? 0 : AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return bits;
+  }
+  if (IS_OBJ(value)) return (uint64_t)(uintptr_t)AS_OBJ(value);
+  return IS_BOOL(value) ? 1 + AS_BOOL(value) : 0;
+}
+
+// Fibonacci hashing, the high bits are the best mixed
+static int constant_slot(const ConstantIndex *index, const Value value) {
+  return (int)((constant_bits(value) * 0x9E3779B97F4A7C15ULL) >> 32) & (index->capacity - 1);
+}
+
+static void index_constant(ConstantIndex *index, const Value value, const int constant) {
+  int slot = constant_slot(index, value);
+  while (index->slots[slot] != 0) slot = (slot + 1) & (index->capacity - 1);
+  index->slots[slot] = constant + 1;
+  ++index->count;
+}
+
+static void grow_constant_index(ConstantIndex *index, const Chunk *chunk) {
+  FREE_ARRAY(int, index->slots, index->capacity);
+  index->capacity = index->capacity < 16 ? 16 : index->capacity * 2;
+  index->slots = ALLOCATE(int, index->capacity);
+  memset(index->slots, 0, sizeof(int) * index->capacity);
+
+  index->count = 0;
+  for (int i = 0; i < chunk->constants.length; ++i) {
+    index_constant(index, chunk->constants.values[i], i);
+  }
+}
+
+int add_constant(Chunk *chunk, ConstantIndex *index, const Value value) {
+  if (index->count > 0) {
+    for (int slot = constant_slot(index, value); index->slots[slot] != 0;
+         slot = (slot + 1) & (index->capacity - 1)) {
+      const int constant = index->slots[slot] - 1;
+      if (values_equal(chunk->constants.values[constant], value)) return constant;
+    }
+  }
 
   // push and pop fix the bug, for clear stack.
   // If in write_value_array we realloc memory, then value missed
   // pushed it, before it missed
   push(value);
   write_value_array(&chunk->constants, value);
+  if (index->count + 1 > index->capacity * CONSTANT_INDEX_MAX_LOAD) {
+    grow_constant_index(index, chunk);
+  } else {
+    index_constant(index, value, chunk->constants.length - 1);
+  }
   pop();
   return chunk->constants.length - 1;
+}
+int add_inline_cache(Chunk *chunk) {
+  if (chunk->cache_capacity < chunk->cache_count + 1) {
+    const int old_capacity = chunk->cache_capacity;
+    chunk->cache_capacity = GROW_CAPACITY(old_capacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, old_capacity, chunk->cache_capacity);
+  }
+
+  InlineCache *cache = &chunk->caches[chunk->cache_count];
+  cache->count = 0;
+  cache->hits = cache->misses = 0;
+  return chunk->cache_count++;
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include "value.h"
 
 // Can be expanded over time
+// Every new opcode also needs a label in dispatch_table inside vm.c run()
+// and a name in opcode_names inside debug.c
 typedef enum {
   OP_CONSTANT,
   OP_NIL,
@@ -16,6 +18,8 @@ typedef enum {
   OP_GET_GLOBAL,
   OP_DEFINE_GLOBAL,
   OP_SET_GLOBAL,
+  OP_GET_GLOBAL_SLOT,
+  OP_SET_GLOBAL_SLOT,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
   OP_GET_PROPERTY,
@@ -37,25 +41,93 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,
   OP_INVOKE,
   OP_CLOSURE,
   OP_ACTOR,
   OP_MESSAGE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
+
+  // Superinstructions, compiler fuses common pairs into them (emit_op in compiler.c)
+  OP_GET_LOCALS,
+  OP_GET_LOCAL_PROPERTY,
+  OP_SET_LOCAL_POP,
+  OP_SET_GLOBAL_SLOT_POP,
+  OP_SET_PROPERTY_POP,
+  OP_ADD_LOCALS,
+  OP_ADD_CONSTANT,
+  OP_SUBTRACT_CONSTANT,
+  OP_LESS_CONSTANT,
+  OP_JUMP_IF_FALSE_POP,
+  OP_RETURN_LOCAL,
+
+  // Register ops: dst, left, right (see RK_CONSTANT). Keep them together, from ADD to NOT_EQUAL
+  OP_ADD_RK,
+  OP_SUBTRACT_RK,
+  OP_MULTIPLY_RK,
+  OP_DIVIDE_RK,
+  OP_LESS_RK,
+  OP_LESS_EQUAL_RK,
+  OP_GREATER_RK,
+  OP_GREATER_EQUAL_RK,
+  OP_EQUAL_RK,
+  OP_NOT_EQUAL_RK,
+
+  OP_COUNT,  // Not an opcode, just number of them
 } OpCode;
 
+// Operand of register ops is a frame slot, or a constant index with this bit set
+#define RK_CONSTANT 0x8000
+#define RK_PUSH     0xffff  // As destination: push the result to the stack
+
+// Polymorphic inline cache for one OP_INVOKE, OP_GET_PROPERTY or OP_SET_PROPERTY site.
+// Instruction keeps index of its cache as last operand.
+// Key is the receiver layout (ObjActor* for messages, ObjShape* for fields),
+// on hit we skip the hash lookup
+#define INLINE_CACHE_SIZE 4
+
+typedef struct {
+  Obj *key;
+  Value value;  // Resolved closure for OP_INVOKE, shape after the store for OP_SET_PROPERTY
+  int index;    // Field slot for OP_GET_PROPERTY and OP_SET_PROPERTY
+} CacheEntry;
+
+typedef struct {
+  int count;
+  uint32_t hits;
+  uint32_t misses;
+  CacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
 typedef struct {
   int length;
   int capacity;
   uint16_t *code;
   int *lines;  // To track errors
   ValueArray constants;
+
+  int cache_count;
+  int cache_capacity;
+  InlineCache *caches;
 } Chunk;
 
+// Constant -> its index in Chunk.constants, so add_constant() finds a duplicate without
+// scanning the pool. Compiler keeps one for each function it compiles and drops it at the end.
+// Objects are keys by address: heap is compacted only while the VM runs, never in compile()
+typedef struct {
+  int count;
+  int capacity;  // Power of two
+  int *slots;    // Constant index + 1, 0 is an empty slot
+} ConstantIndex;
+
+void init_constant_index(ConstantIndex *index);
+void free_constant_index(ConstantIndex *index);
+
 void init_chunk(Chunk *chunk);
 void free_chunk(Chunk *chunk);
 void write_chunk(Chunk *chunk, uint16_t byte, int line);
-int add_constant(Chunk *chunk, Value value);
+int add_constant(Chunk *chunk, ConstantIndex *index, Value value);
+int add_inline_cache(Chunk *chunk);
 
 #endif // PL_CHUNK_H
\ No newline at end of file
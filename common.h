@@ -11,8 +11,30 @@
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
 
-#define DEBUG_STRESS_GC  // If set, start as possible as can
+// #define DEBUG_STRESS_GC  // If set, start as possible as can. Default of --gc-mode
 // #define DEBUG_LOG_GC
+// #define DEBUG_PRINT_IC_STATS  // Hits and misses of every inline cache at exit
+// #define DEBUG_PROFILE_OPCODES // Most frequent executed opcode pairs at exit
+// #define DEBUG_PRINT_GC_STATS  // Collection counts and pause percentiles at exit
+
+// Threaded dispatch in run() with "labels as values" (GCC/Clang extension).
+// Other compilers fall back to the portable switch loop
+#if defined(__GNUC__) || defined(__clang__)
+#define USE_COMPUTED_GOTO
+#endif
+
+// Pack every Value into 8 bytes (see value.h).
+// Comment out to get the tagged union back, e.g. for debugging
+#define NAN_BOXING
+
+// Stop-the-world marking runs on vm.gc_threads threads (pthreads and GCC/Clang atomics)
+#if defined(__GNUC__) || defined(__clang__)
+#define PARALLEL_MARK
+#endif
+
+// Arithmetic and comparisons on locals and constants compile to three-operand ops.
+// Default for vm.register_ops, 'NeZnayu --stack file' switches it off for one run
+#define REGISTER_OPS
 
 // Only 2^16, because of small size of chunk
 // Need for global vars
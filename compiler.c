@@ -73,6 +73,13 @@ typedef struct Compiler {
   Upvalue *upvalues;  // Array
   int upvalue_capacity;
   int scope_depth;
+
+  // For superinstructions and register ops, see emit_op()
+  int last_instruction;      // Offset of the last opcode passed to emit_op()
+  int previous_instruction;  // And the one before it
+  int jump_target;           // Last offset something jumps to, can't fuse across it
+
+  ConstantIndex constants;   // Of function->chunk, see add_constant()
 } Compiler;
 
 typedef struct ActorCompiler {
@@ -155,6 +162,59 @@ static void emit_bytes(const uint16_t byte1, const uint16_t byte2) {
   emit_byte(byte2);
 }
 
+// Opcode pairs that are the most frequent in test/benchmark (DEBUG_PROFILE_OPCODES).
+// Fused opcode keeps operands of both instructions in the same order,
+// so first one is just rewritten in place and nothing moves
+typedef struct {
+  OpCode first;
+  int first_length;  // With operands
+  OpCode second;
+  OpCode fused;
+} Superinstruction;
+
+static const Superinstruction superinstructions[] = {
+  {OP_GET_LOCAL,       2, OP_GET_PROPERTY, OP_GET_LOCAL_PROPERTY},
+  {OP_GET_LOCAL,       2, OP_GET_LOCAL,    OP_GET_LOCALS},
+  {OP_GET_LOCALS,      3, OP_ADD,          OP_ADD_LOCALS},
+  {OP_GET_LOCAL,       2, OP_RETURN,       OP_RETURN_LOCAL},
+  {OP_CONSTANT,        2, OP_ADD,          OP_ADD_CONSTANT},
+  {OP_CONSTANT,        2, OP_SUBTRACT,     OP_SUBTRACT_CONSTANT},
+  {OP_CONSTANT,        2, OP_LESS,         OP_LESS_CONSTANT},
+  {OP_JUMP_IF_FALSE,   3, OP_POP,          OP_JUMP_IF_FALSE_POP},
+  {OP_SET_LOCAL,       2, OP_POP,          OP_SET_LOCAL_POP},
+  {OP_SET_GLOBAL_SLOT, 2, OP_POP,          OP_SET_GLOBAL_SLOT_POP},
+  {OP_SET_PROPERTY,    3, OP_POP,          OP_SET_PROPERTY_POP},
+};
+
+// Use it instead of emit_byte() for opcodes, that can be fused with the previous one.
+// Fusing is allowed only if the previous instruction was emitted here too,
+// all its operands are already written and nobody jumps between the two
+static void emit_op(const OpCode op) {
+  Chunk *chunk = current_chunk();
+  const int last = current->last_instruction;
+
+  if (last != -1 && last >= current->jump_target) {
+    for (size_t i = 0; i < sizeof(superinstructions) / sizeof(Superinstruction); ++i) {
+      const Superinstruction *rule = &superinstructions[i];
+      if (rule->second == op && chunk->code[last] == rule->first &&
+          last + rule->first_length == chunk->length) {
+        chunk->code[last] = rule->fused;
+        return;
+      }
+    }
+  }
+
+  current->previous_instruction = last;
+  current->last_instruction = chunk->length;
+  emit_byte(op);
+}
+
+// Loop starts and patched jumps
+static int mark_jump_target() {
+  current->jump_target = current_chunk()->length;
+  return current->jump_target;
+}
+
 static void emit_loop(const int loop_start) {
   emit_byte(OP_LOOP);
 
@@ -166,8 +226,8 @@ static void emit_loop(const int loop_start) {
 }
 
 // TODO Maybe rework with "long jump" instruction
-static int emit_jump(const uint16_t instruction) {
-  emit_byte(instruction);
+static int emit_jump(const OpCode instruction) {
+  emit_op(instruction);
   // 0xffffffff - 32 bytes
   emit_byte(0xffff);
   emit_byte(0xffff);
@@ -176,29 +236,42 @@ static int emit_jump(const uint16_t instruction) {
 
 static void emit_return() {
   if (current->type == TYPE_MESSAGE) {
-    emit_bytes(OP_GET_LOCAL, 0);
+    emit_op(OP_GET_LOCAL);
+    emit_byte(0);
   } else {
     emit_byte(OP_NIL);
   }
 
-  emit_byte(OP_RETURN);
+  emit_op(OP_RETURN);
 }
 
 static uint16_t make_constant(const Value value) {
-  const int constant = add_constant(current_chunk(), value);
+  const int constant = add_constant(current_chunk(), &current->constants, value);
+  write_barrier((Obj*)current->function, value);
   if (constant <= UINT16_MAX) return constant;
   
   error("Too many constants in one chunk.");
   return 0;
 }
 
+static uint16_t make_inline_cache() {
+  const int cache = add_inline_cache(current_chunk());
+  if (cache <= UINT16_MAX) return cache;
+
+  error("Too many property accesses and sends in one chunk.");
+  return 0;
+}
+
+// Value must get into constants before the code array grows and starts GC
 static void emit_constant(const Value value) {
-  emit_bytes(OP_CONSTANT, make_constant(value));
+  const uint16_t constant = make_constant(value);
+  emit_op(OP_CONSTANT);
+  emit_byte(constant);
 }
 
 static void patch_jump(const int offset) {
   // -2 to adjust for the bytecode for the jump offset itself
-  const int jump = current_chunk()->length - offset - 2;
+  const int jump = mark_jump_target() - offset - 2;
 
   if (jump > UINT32_MAX/3) {
     error("Too much code to jump over.");
@@ -214,7 +287,10 @@ static void init_compiler(Compiler *compiler, const FunctionType type) {
   compiler->type = type;
   compiler->local_count = 0;
   compiler->scope_depth = 0;
-  
+  compiler->last_instruction = compiler->previous_instruction = -1;
+  compiler->jump_target = 0;
+  init_constant_index(&compiler->constants);
+
   compiler->local_capacity = GROW_CAPACITY(0);
   compiler->upvalue_capacity = GROW_CAPACITY(0);
   compiler->locals = NULL;  // To prevent UB from compiler
@@ -228,6 +304,7 @@ static void init_compiler(Compiler *compiler, const FunctionType type) {
   // Function live like global vars, so need own copy
   if (type != TYPE_SCRIPT) {
     current->function->name = copy_string(parser.previous.start, parser.previous.length);
+    write_barrier((Obj*)current->function, OBJ_VAL((Obj*)current->function->name));
   }
 
   Local *local = &current->locals[current->local_count++];
@@ -247,6 +324,7 @@ static void init_compiler(Compiler *compiler, const FunctionType type) {
 static void free_compiler(Compiler *compiler) {
   FREE_ARRAY(Local, compiler->locals, compiler->local_capacity);
   FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalue_capacity);
+  free_constant_index(&compiler->constants);
 }
 
 static ObjFunction *end_compiler() {
@@ -277,7 +355,7 @@ static void end_scope() {
     if (current->locals[current->local_count - 1].is_captured) {
       emit_byte(OP_CLOSE_UPVALUE);
     } else {
-      emit_byte(OP_POP);
+      emit_op(OP_POP);
     }
     --current->local_count;
   }
@@ -353,6 +431,17 @@ static int resolve_upvalue(Compiler *compiler, const Token *name) {
   return -1;
 }
 
+// Globals live in vm.globals for the whole VM life, so the slot is fixed at compile time.
+// Variable may be still undefined here (forward reference, next REPL line),
+// the VM checks it when the instruction runs
+static int resolve_global(const Token *name) {
+  ObjString *string = copy_string(name->start, name->length);
+  push(OBJ_VAL((Obj*)string));
+  const int slot = global_resolve(&vm.globals, string);
+  pop();
+  return slot;
+}
+
 static void add_local(const Token name, const bool constant) {
   if (current->local_count == current->local_capacity) {
     const int old_capacity = current->local_capacity;
@@ -429,35 +518,110 @@ static uint16_t argument_list() {
 static void and_(const bool can_assign) {
   const int end_jump = emit_jump(OP_JUMP_IF_FALSE);
 
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
   parse_precedence(PREC_AND);
 
   patch_jump(end_jump);
 }
 
+// Register ops (vm.register_ops) read locals and constants right from the frame,
+// without pushing them first. Operand is a slot or a constant index with RK_CONSTANT set
+static bool register_operand(const int offset, uint16_t *operand) {
+  const Chunk *chunk = current_chunk();
+  const uint16_t arg = chunk->code[offset + 1];
+  if (arg >= RK_CONSTANT) return false;
+
+  switch (chunk->code[offset]) {
+    case OP_GET_LOCAL: *operand = arg; return true;
+    case OP_CONSTANT:  *operand = arg | RK_CONSTANT; return true;
+    default:           return false;
+  }
+}
+
+// Offset of the left operand, if it's a single local or constant at the end of the code.
+// Jump target after it means it was only a part of 'and' or 'or'
+static int register_operand_start() {
+  const int last = current->last_instruction;
+  uint16_t operand;
+  if (last == -1 || last < current->jump_target ||
+      last + 2 != current_chunk()->length || !register_operand(last, &operand)) {
+    return -1;
+  }
+  return last;
+}
+
+// Both operands are loaded by the last instructions, so drop the loads
+// and emit one register op with the result on the stack
+static bool emit_register_op(const OpCode op, const int left) {
+  if (left == -1 || left < current->jump_target) return false;
+
+  Chunk *chunk = current_chunk();
+  uint16_t a, b;
+  if (left + 4 != chunk->length ||
+      !register_operand(left, &a) || !register_operand(left + 2, &b)) {
+    return false;
+  }
+
+  chunk->length = left;
+  current->last_instruction = current->previous_instruction = -1;
+  emit_op(op);
+  emit_byte(RK_PUSH);
+  emit_bytes(a, b);
+  return true;
+}
+
+// 'x = a + b;' for local x: register op writes straight to the slot,
+// instead of push, OP_SET_LOCAL and OP_POP
+static bool store_register_result() {
+  if (!vm.register_ops) return false;
+
+  Chunk *chunk = current_chunk();
+  const int set = current->last_instruction;
+  const int op = current->previous_instruction;
+  if (set == -1 || op == -1 || op < current->jump_target) return false;
+  if (chunk->code[set] != OP_SET_LOCAL || set + 2 != chunk->length) return false;
+  if (op + 4 != set || chunk->code[op] < OP_ADD_RK || chunk->code[op] > OP_NOT_EQUAL_RK ||
+      chunk->code[op + 1] != RK_PUSH) {
+    return false;
+  }
+
+  chunk->code[op + 1] = chunk->code[set + 1];
+  chunk->length = set;
+  current->last_instruction = op;
+  current->previous_instruction = -1;
+  return true;
+}
+
 static void binary(const bool can_assign) {
   const TokenType operator_type = parser.previous.type;
   const ParseRule *rule = get_rule(operator_type);
+  const int left = vm.register_ops ? register_operand_start() : -1;
+  // Right operand must start with its own instruction, not fused into OP_GET_LOCALS
+  if (left != -1) current->last_instruction = -1;
   parse_precedence((Precedence)(rule->precedence + 1));
 
+  OpCode op, register_op;
   switch (operator_type) {
-    case TOKEN_BANG_EQUAL:    emit_byte(OP_NOT_EQUAL); break;
-    case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL); break;
-    case TOKEN_GREATER:       emit_byte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emit_byte(OP_GREATER_EQUAL); break;
-    case TOKEN_LESS:          emit_byte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emit_byte(OP_LESS_EQUAL); break;
-    case TOKEN_PLUS:          emit_byte(OP_ADD);      break;
-    case TOKEN_MINUS:         emit_byte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emit_byte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emit_byte(OP_DIVIDE);   break;
+    case TOKEN_BANG_EQUAL:    op = OP_NOT_EQUAL;     register_op = OP_NOT_EQUAL_RK; break;
+    case TOKEN_EQUAL_EQUAL:   op = OP_EQUAL;         register_op = OP_EQUAL_RK; break;
+    case TOKEN_GREATER:       op = OP_GREATER;       register_op = OP_GREATER_RK; break;
+    case TOKEN_GREATER_EQUAL: op = OP_GREATER_EQUAL; register_op = OP_GREATER_EQUAL_RK; break;
+    case TOKEN_LESS:          op = OP_LESS;          register_op = OP_LESS_RK; break;
+    case TOKEN_LESS_EQUAL:    op = OP_LESS_EQUAL;    register_op = OP_LESS_EQUAL_RK; break;
+    case TOKEN_PLUS:          op = OP_ADD;           register_op = OP_ADD_RK; break;
+    case TOKEN_MINUS:         op = OP_SUBTRACT;      register_op = OP_SUBTRACT_RK; break;
+    case TOKEN_STAR:          op = OP_MULTIPLY;      register_op = OP_MULTIPLY_RK; break;
+    case TOKEN_SLASH:         op = OP_DIVIDE;        register_op = OP_DIVIDE_RK; break;
     default:                  return; // Unreachable;
   }
+
+  if (!emit_register_op(register_op, left)) emit_op(op);
 }
 
 static void call(const bool can_assign) {
   const uint16_t arg_count = argument_list();
-  emit_bytes(OP_CALL, arg_count);
+  emit_op(OP_CALL);
+  emit_byte(arg_count);
 }
 
 // If dot, but not '.send'
@@ -472,11 +636,13 @@ static void dot(const bool can_assign) {
 
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
-    emit_bytes(OP_SET_PROPERTY, name);
+    emit_op(OP_SET_PROPERTY);
+    emit_bytes(name, make_inline_cache());
   } else if (check(TOKEN_LEFT_PAREN)) {
     error_at_current("Can't call message without 'send' keyword.");
   } else {
-    emit_bytes(OP_GET_PROPERTY, name);
+    emit_op(OP_GET_PROPERTY);
+    emit_bytes(name, make_inline_cache());
   }
 }
 
@@ -494,7 +660,7 @@ static void send(const bool can_assign) {
   // TODO think about function call
   const uint16_t arg_count = argument_list();
   emit_bytes(OP_INVOKE, name);
-  emit_byte(arg_count);
+  emit_bytes(arg_count, make_inline_cache());
 }
 
 static void literal(const bool can_assign) {
@@ -523,7 +689,7 @@ static void or_(const bool can_assign) {
   const int end_jump = emit_jump(OP_JUMP);
 
   patch_jump(else_jump);
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
 
   parse_precedence(PREC_OR);
   patch_jump(end_jump);
@@ -536,7 +702,7 @@ static void string(const bool can_assign) {
 }
 
 static void named_variable(const Token name, const bool can_assign) {
-  uint16_t get_op, set_op;
+  OpCode get_op, set_op;
   bool constant = false;
   int arg = resolve_local(current, &name, &constant);
 
@@ -546,6 +712,9 @@ static void named_variable(const Token name, const bool can_assign) {
   } else if ((arg = resolve_upvalue(current, &name)) != -1) {
     get_op = OP_GET_UPVALUE;
     set_op = OP_SET_UPVALUE;
+  } else if ((arg = resolve_global(&name)) != -1) {
+    get_op = OP_GET_GLOBAL_SLOT;
+    set_op = OP_SET_GLOBAL_SLOT;
   } else {
     arg = identifier_constant(&name);
     get_op = OP_GET_GLOBAL;
@@ -558,10 +727,11 @@ static void named_variable(const Token name, const bool can_assign) {
       error_at(&name, "Can't reassign a constant");
       return;
     }
-    emit_bytes(set_op, (uint16_t)arg);
+    emit_op(set_op);
   } else {
-    emit_bytes(get_op, (uint16_t)arg);
+    emit_op(get_op);
   }
+  emit_byte((uint16_t)arg);
 }
 
 static void variable(const bool can_assign) {
@@ -744,7 +914,7 @@ static void actor_declaration() {
     message();
   }
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after actor body.");
-  emit_byte(OP_POP);  // TODO No need too (maybe :D)
+  emit_op(OP_POP);  // TODO No need too (maybe :D)
 
   current_actor = current_actor->enclosing;
 }
@@ -774,7 +944,7 @@ static void var_declaration(const bool constant) {
 static void expression_statement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emit_byte(OP_POP);
+  if (!store_register_result()) emit_op(OP_POP);
 }
 
 static void for_statement() {
@@ -788,7 +958,7 @@ static void for_statement() {
     expression_statement();
   }
 
-  int loop_start = current_chunk()->length;
+  int loop_start = mark_jump_target();
   int exit_jump = -1;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
@@ -796,16 +966,16 @@ static void for_statement() {
 
     // Jump out of the loop if the condition is false
     exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP); // Condition
+    emit_op(OP_POP); // Condition
   }
 
   // After iteration jump to ++ instruction, then jump back, only after that new iter
   // Uhh...? Maybe can find better approach
   if (!match(TOKEN_RIGHT_PAREN)) {
     const int body_jump = emit_jump(OP_JUMP);
-    const int increment_start = current_chunk()->length;
+    const int increment_start = mark_jump_target();
     expression();
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
     emit_loop(loop_start);
@@ -818,7 +988,7 @@ static void for_statement() {
 
   if (exit_jump != -1) {
     patch_jump(exit_jump);
-    emit_byte(OP_POP); // Condition
+    emit_op(OP_POP); // Condition
   }
 
   end_scope();
@@ -831,13 +1001,13 @@ static void if_statement() {
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
   const int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
   statement();
 
   const int else_jump = emit_jump(OP_JUMP);
 
   patch_jump(then_jump);
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
 
   if (match(TOKEN_ELSE)) statement();
   patch_jump(else_jump);
@@ -865,22 +1035,31 @@ static void return_statement() {
 
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-  emit_byte(OP_RETURN);
+
+  // 'return f(x);' doesn't need its own frame. Whole value must be the call,
+  // so nothing may jump to the end of it ('return a or f(x);')
+  Chunk *chunk = current_chunk();
+  const int last = current->last_instruction;
+  if (last != -1 && last >= current->jump_target &&
+      chunk->code[last] == OP_CALL && last + 2 == chunk->length) {
+    chunk->code[last] = OP_TAIL_CALL;
+  }
+  emit_op(OP_RETURN);
 }
 
 static void while_statement() {
-  const int loop_start = current_chunk()->length;
+  const int loop_start = mark_jump_target();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
   const int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
   statement();
   emit_loop(loop_start);
 
   patch_jump(exit_jump);
-  emit_byte(OP_POP);
+  emit_op(OP_POP);
 }
 
 static void synchronize() {
@@ -1,8 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "debug.h"
+#include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassemble_chunk(const Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
@@ -23,12 +26,28 @@ static int constant_instruction(const char *name, const Chunk *chunk, const int
 static int invoke_instruction(const char *name, const Chunk *chunk, const int offset) {
   const uint16_t constant  = chunk->code[offset + 1];
   const uint16_t arg_count = chunk->code[offset + 2];
+  const uint16_t cache     = chunk->code[offset + 3];
   printf("%-16s (%d args) %4d '", name, arg_count, constant);
   print_value(chunk->constants.values[constant]);
-  printf("'\n");
+  printf("' ic %d\n", cache);
+  return offset + 4;
+}
+
+static int property_instruction(const char *name, const Chunk *chunk, const int offset) {
+  const uint16_t constant = chunk->code[offset + 1];
+  const uint16_t cache    = chunk->code[offset + 2];
+  printf("%-16s %4d '", name, constant);
+  print_value(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
   return offset + 3;
 }
 
+static int global_instruction(const char *name, const Chunk *chunk, const int offset) {
+  const uint16_t slot = chunk->code[offset + 1];
+  printf("%-16s %4d '%s'\n", name, slot, vm.globals.values[slot].name->chars);
+  return offset + 2;
+}
+
 static int simple_instruction(const char *name, const int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -40,6 +59,49 @@ static int byte_instruction(const char *name, const Chunk *chunk, const int offs
   return offset + 2;
 }
 
+static int two_byte_instruction(const char *name, const Chunk *chunk, const int offset) {
+  const uint16_t first  = chunk->code[offset + 1];
+  const uint16_t second = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
+// Slot of the receiver, then operands of OP_GET_PROPERTY
+static int local_property_instruction(const char *name, const Chunk *chunk, const int offset) {
+  const uint16_t slot     = chunk->code[offset + 1];
+  const uint16_t constant = chunk->code[offset + 2];
+  const uint16_t cache    = chunk->code[offset + 3];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  print_value(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 4;
+}
+
+static void print_rk_operand(const Chunk *chunk, const uint16_t operand) {
+  if (operand & RK_CONSTANT) {
+    printf(" k%d '", operand & ~RK_CONSTANT);
+    print_value(chunk->constants.values[operand & ~RK_CONSTANT]);
+    printf("'");
+  } else {
+    printf(" r%d", operand);
+  }
+}
+
+// dst, left, right
+static int register_instruction(const char *name, const Chunk *chunk, const int offset) {
+  const uint16_t dst = chunk->code[offset + 1];
+  printf("%-16s", name);
+  if (dst == RK_PUSH) {
+    printf(" push <-");
+  } else {
+    printf(" r%d <-", dst);
+  }
+  print_rk_operand(chunk, chunk->code[offset + 2]);
+  print_rk_operand(chunk, chunk->code[offset + 3]);
+  printf("\n");
+  return offset + 4;
+}
+
 static int jump_instruction(const char *name, const int sign,
                             const Chunk *chunk, const int offset) {
   uint32_t jump = (chunk->code[offset + 1] << 16);
@@ -79,14 +141,18 @@ int disassemble_instruction(const Chunk *chunk, int offset) {
       return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
       return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_SLOT:
+      return global_instruction("OP_GET_GLOBAL_SLOT", chunk, offset);
+    case OP_SET_GLOBAL_SLOT:
+      return global_instruction("OP_SET_GLOBAL_SLOT", chunk, offset);
     case OP_GET_UPVALUE:
       return byte_instruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byte_instruction("OP_SET_UPVALUE", chunk, offset);
     case OP_GET_PROPERTY:
-      return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+      return property_instruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+      return property_instruction("OP_SET_PROPERTY", chunk, offset);
     case OP_EQUAL:
       return simple_instruction("OP_EQUAL", offset);
     case OP_NOT_EQUAL:
@@ -121,6 +187,8 @@ int disassemble_instruction(const Chunk *chunk, int offset) {
       return jump_instruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
       return byte_instruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return byte_instruction("OP_TAIL_CALL", chunk, offset);
     case OP_INVOKE:
       return invoke_instruction("OP_INVOKE", chunk, offset);
     case OP_CLOSURE: {
@@ -149,8 +217,179 @@ int disassemble_instruction(const Chunk *chunk, int offset) {
       return simple_instruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:
       return simple_instruction("OP_RETURN", offset);
+    case OP_GET_LOCALS:
+      return two_byte_instruction("OP_GET_LOCALS", chunk, offset);
+    case OP_GET_LOCAL_PROPERTY:
+      return local_property_instruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+    case OP_SET_LOCAL_POP:
+      return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_SET_GLOBAL_SLOT_POP:
+      return global_instruction("OP_SET_GLOBAL_SLOT_POP", chunk, offset);
+    case OP_SET_PROPERTY_POP:
+      return property_instruction("OP_SET_PROPERTY_POP", chunk, offset);
+    case OP_ADD_LOCALS:
+      return two_byte_instruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_ADD_CONSTANT:
+      return constant_instruction("OP_ADD_CONSTANT", chunk, offset);
+    case OP_SUBTRACT_CONSTANT:
+      return constant_instruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+    case OP_LESS_CONSTANT:
+      return constant_instruction("OP_LESS_CONSTANT", chunk, offset);
+    case OP_JUMP_IF_FALSE_POP:
+      return jump_instruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+    case OP_RETURN_LOCAL:
+      return byte_instruction("OP_RETURN_LOCAL", chunk, offset);
+    case OP_ADD_RK:
+      return register_instruction("OP_ADD_RK", chunk, offset);
+    case OP_SUBTRACT_RK:
+      return register_instruction("OP_SUBTRACT_RK", chunk, offset);
+    case OP_MULTIPLY_RK:
+      return register_instruction("OP_MULTIPLY_RK", chunk, offset);
+    case OP_DIVIDE_RK:
+      return register_instruction("OP_DIVIDE_RK", chunk, offset);
+    case OP_LESS_RK:
+      return register_instruction("OP_LESS_RK", chunk, offset);
+    case OP_LESS_EQUAL_RK:
+      return register_instruction("OP_LESS_EQUAL_RK", chunk, offset);
+    case OP_GREATER_RK:
+      return register_instruction("OP_GREATER_RK", chunk, offset);
+    case OP_GREATER_EQUAL_RK:
+      return register_instruction("OP_GREATER_EQUAL_RK", chunk, offset);
+    case OP_EQUAL_RK:
+      return register_instruction("OP_EQUAL_RK", chunk, offset);
+    case OP_NOT_EQUAL_RK:
+      return register_instruction("OP_NOT_EQUAL_RK", chunk, offset);
     default:
       printf("unknown opcode %d\n", instruction);
       return offset + 1;
   }
+}
+
+static void print_function_caches(Obj *object) {
+  if (object->type != OBJ_FUNCTION) return;
+
+  const ObjFunction *function = (const ObjFunction*)object;
+  for (int i = 0; i < function->chunk.cache_count; ++i) {
+    const InlineCache *cache = &function->chunk.caches[i];
+    printf("%-16s ic %4d: %d entries, %u hits, %u misses\n",
+           function->name != NULL ? function->name->chars : "<script>",
+           i, cache->count, cache->hits, cache->misses);
+  }
+}
+
+void print_inline_cache_stats() {
+  printf("== inline caches ==\n");
+  heap_visit(&vm.heap, print_function_caches);
+}
+
+#ifdef DEBUG_PROFILE_OPCODES
+static const char *opcode_names[OP_COUNT] = {
+  [OP_CONSTANT]            = "OP_CONSTANT",
+  [OP_NIL]                 = "OP_NIL",
+  [OP_TRUE]                = "OP_TRUE",
+  [OP_FALSE]               = "OP_FALSE",
+  [OP_POP]                 = "OP_POP",
+  [OP_GET_LOCAL]           = "OP_GET_LOCAL",
+  [OP_SET_LOCAL]           = "OP_SET_LOCAL",
+  [OP_GET_GLOBAL]          = "OP_GET_GLOBAL",
+  [OP_DEFINE_GLOBAL]       = "OP_DEFINE_GLOBAL",
+  [OP_SET_GLOBAL]          = "OP_SET_GLOBAL",
+  [OP_GET_GLOBAL_SLOT]     = "OP_GET_GLOBAL_SLOT",
+  [OP_SET_GLOBAL_SLOT]     = "OP_SET_GLOBAL_SLOT",
+  [OP_GET_UPVALUE]         = "OP_GET_UPVALUE",
+  [OP_SET_UPVALUE]         = "OP_SET_UPVALUE",
+  [OP_GET_PROPERTY]        = "OP_GET_PROPERTY",
+  [OP_SET_PROPERTY]        = "OP_SET_PROPERTY",
+  [OP_EQUAL]               = "OP_EQUAL",
+  [OP_NOT_EQUAL]           = "OP_NOT_EQUAL",
+  [OP_GREATER]             = "OP_GREATER",
+  [OP_GREATER_EQUAL]       = "OP_GREATER_EQUAL",
+  [OP_LESS]                = "OP_LESS",
+  [OP_LESS_EQUAL]          = "OP_LESS_EQUAL",
+  [OP_ADD]                 = "OP_ADD",
+  [OP_SUBTRACT]            = "OP_SUBTRACT",
+  [OP_MULTIPLY]            = "OP_MULTIPLY",
+  [OP_DIVIDE]              = "OP_DIVIDE",
+  [OP_NOT]                 = "OP_NOT",
+  [OP_NEGATE]              = "OP_NEGATE",
+  [OP_PRINT]               = "OP_PRINT",
+  [OP_JUMP]                = "OP_JUMP",
+  [OP_JUMP_IF_FALSE]       = "OP_JUMP_IF_FALSE",
+  [OP_LOOP]                = "OP_LOOP",
+  [OP_CALL]                = "OP_CALL",
+  [OP_TAIL_CALL]           = "OP_TAIL_CALL",
+  [OP_INVOKE]              = "OP_INVOKE",
+  [OP_CLOSURE]             = "OP_CLOSURE",
+  [OP_ACTOR]               = "OP_ACTOR",
+  [OP_MESSAGE]             = "OP_MESSAGE",
+  [OP_CLOSE_UPVALUE]       = "OP_CLOSE_UPVALUE",
+  [OP_RETURN]              = "OP_RETURN",
+  [OP_GET_LOCALS]          = "OP_GET_LOCALS",
+  [OP_GET_LOCAL_PROPERTY]  = "OP_GET_LOCAL_PROPERTY",
+  [OP_SET_LOCAL_POP]       = "OP_SET_LOCAL_POP",
+  [OP_SET_GLOBAL_SLOT_POP] = "OP_SET_GLOBAL_SLOT_POP",
+  [OP_SET_PROPERTY_POP]    = "OP_SET_PROPERTY_POP",
+  [OP_ADD_LOCALS]          = "OP_ADD_LOCALS",
+  [OP_ADD_CONSTANT]        = "OP_ADD_CONSTANT",
+  [OP_SUBTRACT_CONSTANT]   = "OP_SUBTRACT_CONSTANT",
+  [OP_LESS_CONSTANT]       = "OP_LESS_CONSTANT",
+  [OP_JUMP_IF_FALSE_POP]   = "OP_JUMP_IF_FALSE_POP",
+  [OP_RETURN_LOCAL]        = "OP_RETURN_LOCAL",
+  [OP_ADD_RK]              = "OP_ADD_RK",
+  [OP_SUBTRACT_RK]         = "OP_SUBTRACT_RK",
+  [OP_MULTIPLY_RK]         = "OP_MULTIPLY_RK",
+  [OP_DIVIDE_RK]           = "OP_DIVIDE_RK",
+  [OP_LESS_RK]             = "OP_LESS_RK",
+  [OP_LESS_EQUAL_RK]       = "OP_LESS_EQUAL_RK",
+  [OP_GREATER_RK]          = "OP_GREATER_RK",
+  [OP_GREATER_EQUAL_RK]    = "OP_GREATER_EQUAL_RK",
+  [OP_EQUAL_RK]            = "OP_EQUAL_RK",
+  [OP_NOT_EQUAL_RK]        = "OP_NOT_EQUAL_RK",
+};
+
+typedef struct {
+  uint16_t previous;
+  uint16_t current;
+  uint64_t count;
+} OpcodePair;
+
+static int compare_pairs(const void *a, const void *b) {
+  const uint64_t left = ((const OpcodePair*)a)->count;
+  const uint64_t right = ((const OpcodePair*)b)->count;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+// Candidates for superinstructions are at the top
+void print_opcode_profile() {
+  static OpcodePair pairs[OP_COUNT * OP_COUNT];
+  int count = 0;
+  uint64_t total = 0;
+
+  for (int i = 0; i < OP_COUNT; ++i) {
+    for (int j = 0; j < OP_COUNT; ++j) {
+      if (vm.opcode_pairs[i][j] == 0) continue;
+      pairs[count++] = (OpcodePair){i, j, vm.opcode_pairs[i][j]};
+      total += vm.opcode_pairs[i][j];
+    }
+  }
+  qsort(pairs, count, sizeof(OpcodePair), compare_pairs);
+
+  printf("== opcode pairs (%llu dispatches) ==\n", (unsigned long long)total);
+  for (int i = 0; i < count && i < 30; ++i) {
+    printf("%-20s %-20s %12llu %5.1f%%\n",
+           opcode_names[pairs[i].previous], opcode_names[pairs[i].current],
+           (unsigned long long)pairs[i].count, 100.0 * (double)pairs[i].count / (double)total);
+  }
+}
+#endif
+void print_gc_stats() {
+  const GcStats *stats = &vm.gc_stats;
+  printf("== gc ==\n");
+  printf("minor %llu, major %llu, pauses %llu\n", (unsigned long long)stats->minor_count,
+         (unsigned long long)stats->major_count, (unsigned long long)stats->pause_count);
+  if (stats->pause_count == 0) return;
+
+  printf("pause avg %.1fus, p50 %.0fus, p99 %.0fus, max %.1fus\n",
+         (double)stats->pause_total_ns / 1000.0 / (double)stats->pause_count,
+         gc_pause_percentile(50), gc_pause_percentile(99), (double)stats->pause_max_ns / 1000.0);
 }
\ No newline at end of file
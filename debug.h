@@ -5,5 +5,8 @@
 
 void disassemble_chunk(const Chunk *chunk, const char *name);
 int disassemble_instruction(const Chunk *chunk, int offset);
+void print_inline_cache_stats();
+void print_opcode_profile();
+void print_gc_stats();
 
 #endif // PL_DEBUG_H
\ No newline at end of file
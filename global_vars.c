@@ -1,13 +1,44 @@
 #include <string.h>
 #include "global_vars.h"
 #include "memory.h"
+#include "vm.h"
 
-bool global_set(GlobalVarArray *arr, const ObjString *name, const Value value, const bool constant) {
-  if (arr->length == UINT16_MAX) return false;
+void init_globals(GlobalVarArray *arr) {
+  arr->length = 0;
+  init_table(&arr->slots);
+}
+
+void free_globals(GlobalVarArray *arr) {
+  free_table(&arr->slots);
+  init_globals(arr);
+}
+
+int global_resolve(GlobalVarArray *arr, ObjString *name) {
+  Value slot;
+  if (table_get(&arr->slots, name, &slot)) return (int)AS_NUMBER(slot);
+  if (arr->length == UINT16_MAX) return -1;
+
+  GlobalVar *var = &arr->values[arr->length];
+  var->name = name;
+  var->value = NIL_VAL;
+  var->constant = false;
+  var->defined = false;
 
-  arr->values[arr->length].name = name;
-  arr->values[arr->length].value = value;
-  arr->values[arr->length++].constant = constant;
+  // table_set can start GC, and name may be referenced only from here
+  push(OBJ_VAL((Obj*)name));
+  table_set(&arr->slots, name, NUMBER_VAL(arr->length));
+  pop();
+  return arr->length++;
+}
+
+// Redefinition writes to the same slot, so code compiled earlier sees the new value
+bool global_set(GlobalVarArray *arr, ObjString *name, const Value value, const bool constant) {
+  const int ind = global_resolve(arr, name);
+  if (ind == -1) return false;
+
+  arr->values[ind].value = value;
+  arr->values[ind].constant = constant;
+  arr->values[ind].defined = true;
   return true;
 }
 
@@ -16,15 +47,16 @@ void global_set_at(GlobalVarArray *arr, const Value value, const uint16_t ind) {
 }
 
 const GlobalVar *global_find(const GlobalVarArray *arr, const ObjString *name, uint16_t *ind) {
-  for (int i = arr->length-1; i >= 0; --i)
-    if (name == arr->values[i].name) { // string interning here too
-      *ind = i;
-      return &arr->values[i];
-    }
-  return NULL;
+  Value slot;
+  if (!table_get(&arr->slots, name, &slot)) return NULL;
+
+  *ind = (uint16_t)AS_NUMBER(slot);
+  const GlobalVar *var = &arr->values[*ind];
+  return var->defined ? var : NULL;
 }
 
 void mark_globals(GlobalVarArray *arr) {
+  mark_table(&arr->slots);
   for (int i = 0; i < arr->length; ++i) {
     GlobalVar *var = &arr->values[i];
     mark_object((Obj*)var->name);
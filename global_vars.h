@@ -2,20 +2,30 @@
 #define PL_GLOBAL_VARS
 
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
+// Slot can be reserved by the compiler before the definition runs,
+// so forward references and REPL lines get a stable index
 typedef struct {
     const ObjString *name;
     Value value;
     bool constant;
+    bool defined;
 } GlobalVar;
 
 typedef struct {
     int length;
+    Table slots; // name -> slot index, so no linear scan over values
     GlobalVar values[UINT16_COUNT];
 } GlobalVarArray;
 
-bool global_set(GlobalVarArray *arr, const ObjString *name, Value value, bool constant);
+void init_globals(GlobalVarArray *arr);
+void free_globals(GlobalVarArray *arr);
+
+// -1 if all slots are busy, then caller must use name lookup
+int global_resolve(GlobalVarArray *arr, ObjString *name);
+bool global_set(GlobalVarArray *arr, ObjString *name, Value value, bool constant);
 void global_set_at(GlobalVarArray *arr, Value value, uint16_t ind);
 const GlobalVar *global_find(const GlobalVarArray *arr, const ObjString *name, uint16_t *ind);
 
@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+
+// Pages with fewer free cells are skipped by the allocator. Minor GC sweeps every page
+// it allocated into, a few free cells on each full page would make it sweep the whole heap
+#define PAGE_REUSE_DIVISOR 4
+
+#define PAGE_HEADER \
+  ((sizeof(Page) + CELL_ALIGNMENT - 1) / CELL_ALIGNMENT * CELL_ALIGNMENT)
+
+static Obj *cell_at(const Page *page, const int index) {
+  return (Obj*)((char*)page + PAGE_HEADER + (size_t)index * page->cell_size);
+}
+
+static void reset_classes(Heap *heap) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+    SizeClass *size_class = &heap->classes[i];
+    size_class->cursor = size_class->pages;
+    size_class->current = NULL;
+    size_class->free_cells = NULL;
+  }
+}
+
+void init_heap(Heap *heap) {
+  int cell_size = 16;  // Obj alone
+  for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+    heap->classes[i].pages = NULL;
+    heap->classes[i].cell_size = cell_size;
+    cell_size += cell_size < 128 ? 8 : cell_size < 256 ? 16 : 32;
+  }
+
+  int size_class = 0;
+  for (int words = 0; words <= HEAP_MAX_CELL / CELL_ALIGNMENT; ++words) {
+    if (words * CELL_ALIGNMENT > heap->classes[size_class].cell_size) ++size_class;
+    heap->class_of[words] = (uint8_t)size_class;
+  }
+  reset_classes(heap);
+  heap->active = NULL;
+  heap->large = NULL;
+  heap->evacuated = NULL;
+  heap->spare = NULL;
+  heap->spare_count = 0;
+  heap->page_count = 0;
+  heap->pending_pages = 0;
+  heap->sweep_class = 0;
+  heap->sweep_page = NULL;
+}
+
+static Page *new_page(Heap *heap, SizeClass *size_class) {
+  Page *page = heap->spare;
+  if (page != NULL) {
+    heap->spare = page->next;
+    --heap->spare_count;
+  } else {
+    page = (Page*)malloc(PAGE_SIZE);
+    if (page == NULL) exit(1);
+  }
+
+  page->cell_size = size_class->cell_size;
+  page->cell_count = (int)((PAGE_SIZE - PAGE_HEADER) / page->cell_size);
+  page->live = 0;
+  page->needs_sweep = false;
+  page->is_active = false;
+  page->next_active = NULL;
+
+  // Built backwards, so cells are handed out in address order
+  Obj *free_cells = NULL;
+  for (int i = page->cell_count - 1; i >= 0; --i) {
+    Obj *cell = cell_at(page, i);
+    cell->mark = MARK_FREE;
+    cell->next = free_cells;
+    free_cells = cell;
+  }
+  page->free_cells = free_cells;
+
+  page->next = size_class->pages;
+  size_class->pages = page;
+  ++heap->page_count;
+  return page;
+}
+
+// Unmarked cells are garbage. Marks stay set: survivors are old from now on
+static void sweep_page(Heap *heap, Page *page) {
+  Obj *free_cells = NULL;
+  int live = 0;
+  for (int i = page->cell_count - 1; i >= 0; --i) {
+    Obj *cell = cell_at(page, i);
+    if (cell->mark != MARK_FREE) {
+      if (IS_MARKED(cell)) {
+        ++live;
+        continue;
+      }
+      free_object(cell);
+      cell->mark = MARK_FREE;
+    }
+    cell->next = free_cells;
+    free_cells = cell;
+  }
+
+  page->free_cells = free_cells;
+  page->live = live;
+  if (page->needs_sweep) {
+    page->needs_sweep = false;
+    --heap->pending_pages;
+  }
+}
+
+// Next page with enough free cells, swept on the way if a major cycle left it dirty
+static void refill(Heap *heap, SizeClass *size_class) {
+  for (;;) {
+    Page *page = size_class->cursor;
+    if (page == NULL) {
+      page = new_page(heap, size_class);
+    } else {
+      size_class->cursor = page->next;
+      if (page->needs_sweep) sweep_page(heap, page);
+    }
+    if (page->free_cells == NULL ||
+        page->cell_count - page->live < page->cell_count / PAGE_REUSE_DIVISOR) continue;
+
+    size_class->current = page;
+    size_class->free_cells = page->free_cells;
+    page->free_cells = NULL;
+    if (!page->is_active) {
+      page->is_active = true;
+      page->next_active = heap->active;
+      heap->active = page;
+    }
+    return;
+  }
+}
+
+// Big object, or the free list of its class is empty
+Obj *heap_allocate_slow(Heap *heap, const size_t size) {
+  if (size > HEAP_MAX_CELL) {
+    Obj *object = (Obj*)malloc(size);
+    if (object == NULL) exit(1);
+    object->next = heap->large;
+    heap->large = object;
+    return object;
+  }
+
+  SizeClass *size_class =
+    &heap->classes[heap->class_of[(size + CELL_ALIGNMENT - 1) / CELL_ALIGNMENT]];
+  refill(heap, size_class);
+
+  Obj *cell = size_class->free_cells;
+  size_class->free_cells = cell->next;
+  ++size_class->current->live;
+  return cell;
+}
+
+static void sweep_large(Heap *heap) {
+  Obj **link = &heap->large;
+  while (*link != NULL) {
+    Obj *object = *link;
+    if (IS_MARKED(object)) {
+      link = &object->next;
+    } else {
+      *link = object->next;
+      free_object(object);
+      free(object);
+    }
+  }
+}
+
+// Only between collections: nobody holds a free list or a page cursor then
+static void release_empty_pages(Heap *heap) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+    Page **link = &heap->classes[i].pages;
+    while (*link != NULL) {
+      Page *page = *link;
+      if (page->live == 0 && !page->needs_sweep) {
+        *link = page->next;
+        if (heap->spare_count < HEAP_SPARE_PAGES) {
+          page->next = heap->spare;
+          heap->spare = page;
+          ++heap->spare_count;
+        } else {
+          free(page);
+        }
+        --heap->page_count;
+      } else {
+        link = &page->next;
+      }
+    }
+  }
+  reset_classes(heap);
+  heap->sweep_class = 0;
+  heap->sweep_page = heap->classes[0].pages;
+}
+
+// Minor GC. Young objects are only on active pages and in the large list
+void sweep_young(Heap *heap) {
+  reset_classes(heap);
+  for (Page *page = heap->active; page != NULL; page = page->next_active) {
+    page->is_active = false;
+    sweep_page(heap, page);
+  }
+  heap->active = NULL;
+  sweep_large(heap);
+  release_empty_pages(heap);
+}
+
+// After a major mark any page can hold garbage. The allocator sweeps a page
+// before it takes cells from it, sweep_pending() gets the rest between allocations
+void start_lazy_sweep(Heap *heap) {
+  sweep_large(heap);
+  for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+    for (Page *page = heap->classes[i].pages; page != NULL; page = page->next) {
+      page->needs_sweep = true;
+      page->is_active = false;
+    }
+  }
+  heap->active = NULL;
+  heap->pending_pages = heap->page_count;
+  reset_classes(heap);
+  heap->sweep_class = 0;
+  heap->sweep_page = heap->classes[0].pages;
+}
+
+// Sweeps one page that still waits for it, false when there is none
+bool sweep_pending(Heap *heap) {
+  while (heap->pending_pages > 0) {
+    Page *page = heap->sweep_page;
+    if (page == NULL) {
+      heap->sweep_page = heap->classes[++heap->sweep_class].pages;
+      continue;
+    }
+
+    heap->sweep_page = page->next;
+    if (page->needs_sweep) {
+      sweep_page(heap, page);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Every object that may still be used. Unmarked cells on a dirty page are dead
+// and may point to freed objects already
+void heap_visit(Heap *heap, void (*visit)(Obj *object)) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+    for (Page *page = heap->classes[i].pages; page != NULL; page = page->next) {
+      for (int j = 0; j < page->cell_count; ++j) {
+        Obj *cell = cell_at(page, j);
+        if (cell->mark == MARK_FREE || (page->needs_sweep && !IS_MARKED(cell))) continue;
+        visit(cell);
+      }
+    }
+  }
+
+  for (Obj *object = heap->large; object != NULL; object = object->next) {
+    visit(object);
+  }
+}
+
+// Pages compaction could give back: all but those the live cells of each class fit into.
+// Live counts are exact only when no page waits for a sweep
+int heap_spare_pages(const Heap *heap) {
+  int spare = 0;
+  for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+    const Page *page = heap->classes[i].pages;
+    if (page == NULL) continue;
+
+    const int cell_count = page->cell_count;
+    int pages = 0;
+    long live = 0;
+    for (; page != NULL; page = page->next) {
+      ++pages;
+      live += page->live;
+    }
+    spare += pages - (int)((live + cell_count - 1) / cell_count);
+  }
+  return spare;
+}
+
+static int fuller_first(const void *a, const void *b) {
+  return (*(Page* const*)b)->live - (*(Page* const*)a)->live;
+}
+
+// Cells of the sparsest pages of every class move into the fullest ones. A moved cell
+// keeps MARK_FORWARDED and its new address, the emptied pages wait in Heap.evacuated
+// until every reference is fixed. Caller makes sure all cells are live, no page is active
+// and the allocator holds no free list: that is right after sweep_young()
+int heap_evacuate(Heap *heap, void (*moved)(Obj *from, Obj *to)) {
+  Page **order = NULL;
+  int capacity = 0;
+  int evacuated = 0;
+
+  for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+    SizeClass *size_class = &heap->classes[i];
+    int count = 0;
+    long live = 0;
+    for (Page *page = size_class->pages; page != NULL; page = page->next) {
+      if (capacity < count + 1) {
+        capacity = GROW_CAPACITY(capacity);
+        order = (Page**)realloc(order, sizeof(Page*) * capacity);
+        if (order == NULL) exit(1);
+      }
+      order[count++] = page;
+      live += page->live;
+    }
+    if (count < 2) continue;
+
+    const int cell_count = order[0]->cell_count;
+    const int keep = (int)((live + cell_count - 1) / cell_count);
+    if (keep == count) continue;
+
+    qsort(order, count, sizeof(Page*), fuller_first);
+    size_class->pages = NULL;
+    for (int j = keep - 1; j >= 0; --j) {
+      order[j]->next = size_class->pages;
+      size_class->pages = order[j];
+    }
+
+    // Kept pages have room for all the rest, keep is rounded up
+    int target = 0;
+    for (int j = keep; j < count; ++j) {
+      Page *page = order[j];
+      for (int k = 0; k < page->cell_count; ++k) {
+        Obj *cell = cell_at(page, k);
+        if (cell->mark == MARK_FREE) continue;
+
+        while (order[target]->free_cells == NULL) ++target;
+        Obj *to = order[target]->free_cells;
+        order[target]->free_cells = to->next;
+        ++order[target]->live;
+
+        memcpy(to, cell, page->cell_size);
+        moved(cell, to);
+        cell->mark = MARK_FORWARDED;
+        cell->next = to;
+      }
+
+      page->next = heap->evacuated;
+      heap->evacuated = page;
+      --heap->page_count;
+      ++evacuated;
+    }
+  }
+
+  free(order);
+  reset_classes(heap);
+  heap->sweep_class = 0;
+  heap->sweep_page = heap->classes[0].pages;
+  return evacuated;
+}
+
+static void free_pages(Page *page) {
+  while (page != NULL) {
+    Page *next = page->next;
+    free(page);
+    page = next;
+  }
+}
+
+// Nothing points into the evacuated pages any more. Compaction is there
+// to give memory back, so spare pages go too
+void heap_release_evacuated(Heap *heap) {
+  free_pages(heap->evacuated);
+  free_pages(heap->spare);
+  heap->evacuated = heap->spare = NULL;
+  heap->spare_count = 0;
+}
+
+void free_heap(Heap *heap) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+    Page *page = heap->classes[i].pages;
+    while (page != NULL) {
+      Page *next = page->next;
+      for (int j = 0; j < page->cell_count; ++j) {
+        Obj *cell = cell_at(page, j);
+        if (cell->mark != MARK_FREE) free_object(cell);
+      }
+      free(page);
+      page = next;
+    }
+  }
+
+  Obj *object = heap->large;
+  while (object != NULL) {
+    Obj *next = object->next;
+    free_object(object);
+    free(object);
+    object = next;
+  }
+  free_pages(heap->spare);
+  init_heap(heap);
+}
\ No newline at end of file
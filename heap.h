@@ -0,0 +1,92 @@
+#ifndef PL_HEAP_H
+#define PL_HEAP_H
+
+#include "common.h"
+#include "object.h"
+
+// Objects live in pages of PAGE_SIZE bytes, each page holds cells of one size class.
+// There is no list of all objects: sweep walks pages and rebuilds their free lists
+#define PAGE_SIZE (64 * 1024)
+#define CELL_ALIGNMENT 8
+#define HEAP_MAX_CELL 512  // Bigger objects get their own malloc, see Heap.large
+// Classes step by 8 bytes up to 128, where all fixed-size objects are,
+// by 16 up to 256 and by 32 up to HEAP_MAX_CELL. See init_heap()
+#define SIZE_CLASS_COUNT 31
+// Empty pages kept for reuse. Freeing the nursery pages at every minor GC makes malloc
+// give them back to the system and fault them in again right after
+#define HEAP_SPARE_PAGES 16
+
+// Obj.mark of a free cell, never equal to vm.mark_epoch
+#define MARK_FREE 2
+// Obj.mark of a cell moved by heap_evacuate(), Obj.next is where it went
+#define MARK_FORWARDED 3
+
+// Header is followed by the cells
+typedef struct Page {
+  struct Page *next;         // Pages of the same size class
+  struct Page *next_active;  // See Heap.active
+  Obj *free_cells;           // Built by the sweep, the allocator takes it whole
+  int cell_size;
+  int cell_count;
+  int live;                  // Cells in use, exact when the page is swept
+  bool needs_sweep;          // Marked by a major cycle, not swept yet
+  bool is_active;
+} Page;
+
+typedef struct {
+  Page *pages;
+  Page *cursor;      // Next page the allocator looks at
+  Page *current;     // Page the free list below came from
+  Obj *free_cells;
+  int cell_size;
+} SizeClass;
+
+typedef struct {
+  SizeClass classes[SIZE_CLASS_COUNT];
+  uint8_t class_of[HEAP_MAX_CELL / CELL_ALIGNMENT + 1];  // Size in 8-byte words to its class
+  // Pages allocated into since the last GC. Young objects live only there,
+  // so minor GC sweeps these pages and leaves the rest alone
+  Page *active;
+  Obj *large;          // Big objects, linked through Obj.next
+  Page *evacuated;     // Emptied by heap_evacuate(), still hold forwarding addresses
+  Page *spare;         // Empty pages of no class, see HEAP_SPARE_PAGES
+  int spare_count;
+  int page_count;
+  int pending_pages;   // Still to be swept after a major cycle
+  int sweep_class;     // Where sweep_pending() goes on
+  Page *sweep_page;
+} Heap;
+
+void init_heap(Heap *heap);
+void free_heap(Heap *heap);
+Obj *heap_allocate_slow(Heap *heap, size_t size);
+void sweep_young(Heap *heap);
+void start_lazy_sweep(Heap *heap);
+bool sweep_pending(Heap *heap);
+void heap_visit(Heap *heap, void (*visit)(Obj *object));
+int heap_spare_pages(const Heap *heap);
+int heap_evacuate(Heap *heap, void (*moved)(Obj *from, Obj *to));
+void heap_release_evacuated(Heap *heap);
+
+// Memory an object of this size really takes, what vm.bytes_allocated counts
+static inline size_t heap_footprint(const Heap *heap, const size_t size) {
+  if (size > HEAP_MAX_CELL) return size;
+  return heap->classes[heap->class_of[(size + CELL_ALIGNMENT - 1) / CELL_ALIGNMENT]].cell_size;
+}
+
+// Fast path is one pop from the free list of the size class
+static inline Obj *heap_allocate(Heap *heap, const size_t size) {
+  if (size <= HEAP_MAX_CELL) {
+    SizeClass *size_class =
+      &heap->classes[heap->class_of[(size + CELL_ALIGNMENT - 1) / CELL_ALIGNMENT]];
+    Obj *cell = size_class->free_cells;
+    if (cell != NULL) {
+      size_class->free_cells = cell->next;
+      ++size_class->current->live;
+      return cell;
+    }
+  }
+  return heap_allocate_slow(heap, size);
+}
+
+#endif // PL_HEAP_H
\ No newline at end of file
@@ -0,0 +1,611 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define IMAGE_MAGIC "NZIMAGE"
+#define IMAGE_VERSION 1
+
+// Objects are numbered from 1 in the order the writer meets them, 0 is NULL.
+// A reference in the file is such a number, the loader relocates it
+// to the object it has allocated for that record.
+// Header, records, offsets of the records by number, then the globals
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t value_size;    // Tagged union or NAN_BOXING
+  uint32_t opcode_count;
+  uint32_t native_count;  // Natives are saved as their index in natives[]
+  uint32_t object_count;
+  uint32_t global_count;
+  uint64_t offsets_offset;
+  uint64_t globals_offset;
+} ImageHeader;
+
+typedef struct {
+  uint8_t *bytes;
+  size_t length;
+  size_t capacity;
+
+  Obj **objects;      // By number - 1, records are written in this order
+  uint64_t *offsets;
+  int object_count;
+  int object_capacity;
+
+  Obj **keys;         // Object -> number, open addressing
+  uint32_t *numbers;
+  int key_capacity;
+} ImageWriter;
+
+static void put(ImageWriter *writer, const void *data, const size_t size) {
+  if (writer->capacity < writer->length + size) {
+    while (writer->capacity < writer->length + size) writer->capacity = GROW_CAPACITY(writer->capacity);
+    writer->bytes = (uint8_t*)realloc(writer->bytes, writer->capacity);
+    if (writer->bytes == NULL) exit(1);
+  }
+  memcpy(writer->bytes + writer->length, data, size);
+  writer->length += size;
+}
+
+static void put_u8(ImageWriter *writer, const uint8_t value) {
+  put(writer, &value, sizeof(value));
+}
+
+static void put_u32(ImageWriter *writer, const uint32_t value) {
+  put(writer, &value, sizeof(value));
+}
+
+static void put_int(ImageWriter *writer, const int value) {
+  put(writer, &value, sizeof(value));
+}
+
+static size_t hash_pointer(const Obj *object) {
+  return ((uintptr_t)object >> 3) * 0x9E3779B97F4A7C15u;
+}
+
+static void insert_key(ImageWriter *writer, Obj *object, const uint32_t number) {
+  const size_t mask = (size_t)writer->key_capacity - 1;
+  size_t slot = hash_pointer(object) & mask;
+  while (writer->keys[slot] != NULL) slot = (slot + 1) & mask;
+  writer->keys[slot] = object;
+  writer->numbers[slot] = number;
+}
+
+static void grow_keys(ImageWriter *writer) {
+  free(writer->keys);
+  free(writer->numbers);
+  writer->key_capacity = writer->key_capacity == 0 ? 64 : writer->key_capacity * 2;
+  writer->keys = (Obj**)calloc(writer->key_capacity, sizeof(Obj*));
+  writer->numbers = (uint32_t*)malloc(sizeof(uint32_t) * writer->key_capacity);
+  if (writer->keys == NULL || writer->numbers == NULL) exit(1);
+
+  for (int i = 0; i < writer->object_count; ++i) {
+    insert_key(writer, writer->objects[i], (uint32_t)i + 1);
+  }
+}
+
+// First use of an object gives it the next number, its record is written later
+static uint32_t object_number(ImageWriter *writer, Obj *object) {
+  if (object == NULL) return 0;
+  // There are no ropes in an image, a rope is saved as the string it stands for
+  if (object->type == OBJ_ROPE) object = (Obj*)flatten_rope((ObjRope*)object);
+
+  if (writer->key_capacity != 0) {
+    const size_t mask = (size_t)writer->key_capacity - 1;
+    for (size_t slot = hash_pointer(object) & mask; writer->keys[slot] != NULL; slot = (slot + 1) & mask) {
+      if (writer->keys[slot] == object) return writer->numbers[slot];
+    }
+  }
+
+  if (writer->object_capacity < writer->object_count + 1) {
+    writer->object_capacity = GROW_CAPACITY(writer->object_capacity);
+    writer->objects = (Obj**)realloc(writer->objects, sizeof(Obj*) * writer->object_capacity);
+    writer->offsets = (uint64_t*)realloc(writer->offsets, sizeof(uint64_t) * writer->object_capacity);
+    if (writer->objects == NULL || writer->offsets == NULL) exit(1);
+  }
+  writer->objects[writer->object_count++] = object;
+
+  if (writer->object_count * 2 > writer->key_capacity) {
+    grow_keys(writer);
+  } else {
+    insert_key(writer, object, (uint32_t)writer->object_count);
+  }
+  return (uint32_t)writer->object_count;
+}
+
+static void put_ref(ImageWriter *writer, Obj *object) {
+  put_u32(writer, object_number(writer, object));
+}
+
+// Number of the object, or 0 and the Value itself
+static void put_value(ImageWriter *writer, const Value value) {
+  if (IS_OBJ(value)) {
+    put_ref(writer, AS_OBJ(value));
+    return;
+  }
+  put_u32(writer, 0);
+  put(writer, &value, sizeof(value));
+}
+
+static void put_table(ImageWriter *writer, const Table *table) {
+  put_int(writer, table->count);
+  for (const Table *part = table; part != NULL; part = part->old) {
+    for (int i = 0; i < part->capacity; ++i) {
+      const Entry *entry = &part->entries[i];
+      if (entry->key == NULL) continue;
+      put_ref(writer, (Obj*)entry->key);
+      put_value(writer, entry->value);
+    }
+  }
+}
+
+// Fields the loader needs to allocate the object come first, see allocate_record()
+static void write_object(ImageWriter *writer, Obj *object) {
+  put_u8(writer, (uint8_t)object->type);
+  switch (object->type) {
+    case OBJ_ACTOR: {
+      ObjActor *actor = (ObjActor*)object;
+      put_int(writer, actor->field_count);
+      put_ref(writer, (Obj*)actor->name);
+      put_table(writer, &actor->messages);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = (ObjClosure*)object;
+      put_ref(writer, (Obj*)closure->function);
+      put_int(writer, closure->upvalue_count);
+      for (int i = 0; i < closure->upvalue_count; ++i) {
+        put_ref(writer, (Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = (ObjFunction*)object;
+      const Chunk *chunk = &function->chunk;
+      put_int(writer, function->arity);
+      put_int(writer, function->upvalue_count);
+      put_ref(writer, (Obj*)function->name);
+      put_int(writer, chunk->length);
+      put(writer, chunk->code, sizeof(uint16_t) * chunk->length);
+      put(writer, chunk->lines, sizeof(int) * chunk->length);
+      put_int(writer, chunk->constants.length);
+      for (int i = 0; i < chunk->constants.length; ++i) {
+        put_value(writer, chunk->constants.values[i]);
+      }
+      // Inline caches start cold, their shapes and closures belong to this run
+      put_int(writer, chunk->cache_count);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = (ObjInstance*)object;
+      put_ref(writer, (Obj*)instance->actor);
+      put_ref(writer, (Obj*)instance->shape);
+      if (instance->shape == NULL) {
+        put_table(writer, instance->dict);
+        break;
+      }
+      put_int(writer, instance->shape->slot_count);
+      for (int i = 0; i < instance->shape->slot_count; ++i) {
+        put_value(writer, instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_NATIVE:
+      put_int(writer, ((ObjNative*)object)->index);
+      break;
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape*)object;
+      put_ref(writer, (Obj*)shape->parent);
+      put_int(writer, shape->slot_count);
+      put_ref(writer, (Obj*)shape->name);
+      put_table(writer, &shape->transitions);
+      break;
+    }
+    case OBJ_STRING: {
+      const ObjString *string = (ObjString*)object;
+      put_int(writer, string->length);
+      put(writer, string->chars, string->length);
+      break;
+    }
+    case OBJ_UPVALUE:
+      put_value(writer, *((ObjUpvalue*)object)->location);
+      break;
+    case OBJ_ROPE:
+      break;  // Never numbered, see object_number()
+  }
+}
+
+void save_image(const char *path) {
+  ImageWriter writer;
+  memset(&writer, 0, sizeof(writer));
+
+  // Flattening a rope allocates, and the objects waiting for their records are not roots
+  vm.gc_paused = true;
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  put(&writer, &header, sizeof(header));
+
+  for (int i = 0; i < vm.globals.length; ++i) {
+    object_number(&writer, (Obj*)vm.globals.values[i].name);
+    if (IS_OBJ(vm.globals.values[i].value)) object_number(&writer, AS_OBJ(vm.globals.values[i].value));
+  }
+  for (const Table *part = &vm.strings; part != NULL; part = part->old) {
+    for (int i = 0; i < part->capacity; ++i) {
+      object_number(&writer, (Obj*)part->entries[i].key);
+    }
+  }
+
+  // Records number what they reference, so the list grows while it is written
+  for (int i = 0; i < writer.object_count; ++i) {
+    writer.offsets[i] = writer.length;
+    write_object(&writer, writer.objects[i]);
+  }
+
+  header.offsets_offset = writer.length;
+  put(&writer, writer.offsets, sizeof(uint64_t) * writer.object_count);
+
+  header.globals_offset = writer.length;
+  for (int i = 0; i < vm.globals.length; ++i) {
+    const GlobalVar *var = &vm.globals.values[i];
+    put_ref(&writer, (Obj*)var->name);
+    put_value(&writer, var->value);
+    put_u8(&writer, var->constant);
+    put_u8(&writer, var->defined);
+  }
+  vm.gc_paused = false;
+
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.value_size = sizeof(Value);
+  header.opcode_count = OP_COUNT;
+  header.native_count = (uint32_t)native_count;
+  header.object_count = (uint32_t)writer.object_count;
+  header.global_count = (uint32_t)vm.globals.length;
+  memcpy(writer.bytes, &header, sizeof(header));
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL || fwrite(writer.bytes, 1, writer.length, file) != writer.length ||
+      fclose(file) != 0) {
+    fprintf(stderr, "Could not write image \"%s\".\n", path);
+    exit(74);
+  }
+
+  free(writer.bytes);
+  free(writer.objects);
+  free(writer.offsets);
+  free(writer.keys);
+  free(writer.numbers);
+}
+
+typedef struct {
+  const char *path;
+  const uint8_t *bytes;  // The whole file, mapped
+  size_t length;
+  size_t at;
+
+  Obj **objects;  // By number - 1, what references are relocated to
+  uint64_t object_count;
+  uint64_t offsets_offset;
+} ImageReader;
+
+static void corrupt(const ImageReader *reader) {
+  fprintf(stderr, "Image \"%s\" is damaged or was saved by another build.\n", reader->path);
+  exit(65);
+}
+
+static void get(ImageReader *reader, void *data, const size_t size) {
+  if (size > reader->length - reader->at) corrupt(reader);
+  if (size == 0) return;
+  memcpy(data, reader->bytes + reader->at, size);
+  reader->at += size;
+}
+
+static uint8_t get_u8(ImageReader *reader) {
+  uint8_t value;
+  get(reader, &value, sizeof(value));
+  return value;
+}
+
+static uint32_t get_u32(ImageReader *reader) {
+  uint32_t value;
+  get(reader, &value, sizeof(value));
+  return value;
+}
+
+// Counts and lengths, an array of count items must fit in the rest of the file
+static int get_count(ImageReader *reader) {
+  int value;
+  get(reader, &value, sizeof(value));
+  if (value < 0 || (size_t)value > reader->length - reader->at) corrupt(reader);
+  return value;
+}
+
+// Object the loader has allocated for this number, -1 accepts any type
+static Obj *relocate(const ImageReader *reader, const uint32_t number, const int type) {
+  if (number == 0) return NULL;
+  if (number > reader->object_count) corrupt(reader);
+
+  Obj *object = reader->objects[number - 1];
+  if (object == NULL || (type != -1 && object->type != (ObjType)type)) corrupt(reader);
+  return object;
+}
+
+static Obj *get_ref(ImageReader *reader, const int type) {
+  return relocate(reader, get_u32(reader), type);
+}
+
+static Value get_value(ImageReader *reader) {
+  const uint32_t number = get_u32(reader);
+  if (number != 0) return OBJ_VAL(relocate(reader, number, -1));
+
+  Value value;
+  get(reader, &value, sizeof(value));
+  if (IS_OBJ(value)) corrupt(reader);
+  return value;
+}
+
+static ObjString *get_key(ImageReader *reader) {
+  ObjString *key = (ObjString*)get_ref(reader, OBJ_STRING);
+  if (key == NULL) corrupt(reader);
+  return key;
+}
+
+// Owner may be old already, vm.empty_shape is
+static void get_table(ImageReader *reader, Obj *owner, Table *table) {
+  const int count = get_count(reader);
+  for (int i = 0; i < count; ++i) {
+    ObjString *key = get_key(reader);
+    const Value value = get_value(reader);
+    table_set(table, key, value);
+    write_barrier(owner, value);
+  }
+}
+
+// Positions the reader after the type of record number index + 1
+static ObjType begin_record(ImageReader *reader, const uint64_t index) {
+  uint64_t offset;
+  reader->at = reader->offsets_offset + index * sizeof(offset);
+  get(reader, &offset, sizeof(offset));
+  if (offset >= reader->offsets_offset) corrupt(reader);
+
+  reader->at = offset;
+  const uint8_t type = get_u8(reader);
+  if (type > OBJ_UPVALUE || type == OBJ_ROPE) corrupt(reader);
+  return (ObjType)type;
+}
+
+// Closures and instances need their function and actor first, so they come in a second pass
+static Obj *allocate_record(ImageReader *reader, const ObjType type, const bool second_pass) {
+  if ((type == OBJ_CLOSURE || type == OBJ_INSTANCE) != second_pass) return NULL;
+
+  switch (type) {
+    case OBJ_ACTOR: {
+      ObjActor *actor = new_actor(NULL);
+      actor->field_count = get_count(reader);
+      return (Obj*)actor;
+    }
+    case OBJ_CLOSURE: {
+      ObjFunction *function = (ObjFunction*)get_ref(reader, OBJ_FUNCTION);
+      if (function == NULL) corrupt(reader);
+      return (Obj*)new_closure(function);
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = new_function();
+      function->arity = get_count(reader);
+      function->upvalue_count = get_count(reader);
+      return (Obj*)function;
+    }
+    case OBJ_INSTANCE: {
+      ObjActor *actor = (ObjActor*)get_ref(reader, OBJ_ACTOR);
+      if (actor == NULL) corrupt(reader);
+      return (Obj*)new_instance(actor);
+    }
+    case OBJ_NATIVE: {
+      const int index = get_count(reader);
+      if (index >= native_count) corrupt(reader);
+      return (Obj*)new_native(index);
+    }
+    case OBJ_SHAPE: {
+      // Root of the image is the root of this VM, new shapes get linked under it
+      if (get_u32(reader) == 0) return (Obj*)vm.empty_shape;
+      ObjShape *shape = new_shape(NULL, NULL);
+      shape->slot_count = get_count(reader);
+      return (Obj*)shape;
+    }
+    case OBJ_STRING: {
+      const int length = get_count(reader);
+      reader->at += length;
+      return (Obj*)copy_string((const char*)reader->bytes + reader->at - length, length);
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue *upvalue = new_upvalue(NULL);
+      upvalue->location = &upvalue->closed;
+      return (Obj*)upvalue;
+    }
+    case OBJ_ROPE:
+      break;
+  }
+  return NULL;
+}
+
+static void read_chunk(ImageReader *reader, Chunk *chunk) {
+  const int length = get_count(reader);
+  chunk->code = ALLOCATE(uint16_t, length);
+  chunk->lines = ALLOCATE(int, length);
+  chunk->length = chunk->capacity = length;
+  get(reader, chunk->code, sizeof(uint16_t) * length);
+  get(reader, chunk->lines, sizeof(int) * length);
+
+  const int constant_count = get_count(reader);
+  chunk->constants.values = ALLOCATE(Value, constant_count);
+  chunk->constants.capacity = constant_count;
+  for (int i = 0; i < constant_count; ++i) {
+    chunk->constants.values[i] = get_value(reader);
+    chunk->constants.length = i + 1;
+  }
+
+  const int cache_count = get_count(reader);
+  chunk->caches = ALLOCATE(InlineCache, cache_count);
+  chunk->cache_count = chunk->cache_capacity = cache_count;
+  for (int i = 0; i < cache_count; ++i) {
+    chunk->caches[i].count = 0;
+    chunk->caches[i].hits = chunk->caches[i].misses = 0;
+  }
+}
+
+// Rest of the record, now every reference has its object
+static void read_object(ImageReader *reader, Obj *object) {
+  switch (object->type) {
+    case OBJ_ACTOR: {
+      ObjActor *actor = (ObjActor*)object;
+      get_count(reader);
+      actor->name = get_key(reader);
+      get_table(reader, object, &actor->messages);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = (ObjClosure*)object;
+      get_ref(reader, OBJ_FUNCTION);
+      if (get_count(reader) != closure->upvalue_count) corrupt(reader);
+      for (int i = 0; i < closure->upvalue_count; ++i) {
+        closure->upvalues[i] = (ObjUpvalue*)get_ref(reader, OBJ_UPVALUE);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = (ObjFunction*)object;
+      get_count(reader);
+      get_count(reader);
+      function->name = (ObjString*)get_ref(reader, OBJ_STRING);
+      read_chunk(reader, &function->chunk);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = (ObjInstance*)object;
+      get_ref(reader, OBJ_ACTOR);
+      ObjShape *shape = (ObjShape*)get_ref(reader, OBJ_SHAPE);
+      if (shape == NULL) {
+        Table *dict = ALLOCATE(Table, 1);
+        init_table(dict);
+        instance->shape = NULL;
+        instance->dict = dict;
+        get_table(reader, object, dict);
+        break;
+      }
+
+      const int count = get_count(reader);
+      if (count != shape->slot_count || count > instance->capacity) corrupt(reader);
+      instance->shape = shape;
+      for (int i = 0; i < count; ++i) {
+        instance->fields[i] = get_value(reader);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape*)object;
+      ObjShape *parent = (ObjShape*)get_ref(reader, OBJ_SHAPE);
+      get_count(reader);
+      ObjString *name = (ObjString*)get_ref(reader, OBJ_STRING);
+      if (shape != vm.empty_shape) {
+        if (parent == NULL || name == NULL) corrupt(reader);
+        shape->parent = parent;
+        shape->name = name;
+      }
+      get_table(reader, object, &shape->transitions);
+      break;
+    }
+    case OBJ_UPVALUE:
+      ((ObjUpvalue*)object)->closed = get_value(reader);
+      break;
+    case OBJ_NATIVE:
+    case OBJ_ROPE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+// Globals of the image get the same slots, code compiled for it addresses them by slot
+static void read_globals(ImageReader *reader, const uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    ObjString *name = get_key(reader);
+    const Value value = get_value(reader);
+    const bool constant = get_u8(reader);
+    const bool defined = get_u8(reader);
+
+    if (global_resolve(&vm.globals, name) != (int)i) corrupt(reader);
+    GlobalVar *var = &vm.globals.values[i];
+    var->value = value;
+    var->constant = constant;
+    var->defined = defined;
+  }
+}
+
+void load_image(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open image \"%s\".\n", path);
+    exit(74);
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) != 0 || status.st_size < (off_t)sizeof(ImageHeader)) {
+    close(fd);
+    fprintf(stderr, "Could not read image \"%s\".\n", path);
+    exit(74);
+  }
+
+  // Pages of the file come in as the records are read, nothing is copied up front
+  const size_t length = (size_t)status.st_size;
+  void *bytes = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bytes == MAP_FAILED) {
+    fprintf(stderr, "Could not read image \"%s\".\n", path);
+    exit(74);
+  }
+
+  ImageReader reader = {.path = path, .bytes = (const uint8_t*)bytes, .length = length, .at = 0};
+  ImageHeader header;
+  get(&reader, &header, sizeof(header));
+  if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != IMAGE_VERSION || header.value_size != sizeof(Value) ||
+      header.opcode_count != OP_COUNT || header.native_count != (uint32_t)native_count ||
+      header.offsets_offset > length ||
+      (length - header.offsets_offset) / sizeof(uint64_t) < header.object_count ||
+      header.globals_offset > length) {
+    corrupt(&reader);
+  }
+
+  reader.object_count = header.object_count;
+  reader.offsets_offset = header.offsets_offset;
+  reader.objects = (Obj**)calloc(header.object_count + 1, sizeof(Obj*));
+  if (reader.objects == NULL) exit(1);
+
+  // Objects are half-built until the last pass, nothing may trace them
+  vm.gc_paused = true;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (uint64_t i = 0; i < reader.object_count; ++i) {
+      const ObjType type = begin_record(&reader, i);
+      Obj *object = allocate_record(&reader, type, pass == 1);
+      if (object != NULL) reader.objects[i] = object;
+    }
+  }
+  for (uint64_t i = 0; i < reader.object_count; ++i) {
+    begin_record(&reader, i);
+    read_object(&reader, reader.objects[i]);
+  }
+
+  reader.at = header.globals_offset;
+  read_globals(&reader, header.global_count);
+  vm.gc_paused = false;
+
+  free(reader.objects);
+  munmap(bytes, length);
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+#ifndef PL_IMAGE_H
+#define PL_IMAGE_H
+
+#include "common.h"
+
+// Heap image: everything reachable from the globals and the intern table after a prelude
+// has run. Loading it gives a fresh VM the same globals without compiling or running
+// the prelude again. Only the build that wrote an image can read it.
+// Both exit with a message on failure, like read_file() in main.c
+void save_image(const char *path);
+void load_image(const char *path);
+
+#endif // PL_IMAGE_H
\ No newline at end of file
@@ -5,6 +5,8 @@
 // #include "common.h"
 // #include "chunk.h"
 // #include "debug.h"
+#include "image.h"
+#include "memory.h"
 #include "vm.h"
 
 // Some of sysexits codes in C
@@ -68,16 +70,100 @@ static void run_file(const char *path) {
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void usage() {
+  fprintf(stderr, "Usage: NeZnayu [--stack|--register] [--max-frames N] [--gc-mode MODE] "
+                  "[--gc-budget US] [--gc-threads N] [--gc-compact] [--heap-limit MB] "
+                  "[--image FILE] [--save-image FILE] [path]\n");
+  fprintf(stderr, "GC modes: throughput, latency, memory, stress. "
+                  "NEZNAYU_GC_MODE and NEZNAYU_HEAP_LIMIT set defaults\n");
+  fprintf(stderr, "--save-image runs path as a prelude and saves its globals, "
+                  "--image starts with them\n");
+  exit(64);
+}
+
+static GcMode parse_gc_mode(const char *name) {
+  if (strcmp(name, "throughput") == 0) return GC_THROUGHPUT;
+  if (strcmp(name, "latency") == 0) return GC_LATENCY;
+  if (strcmp(name, "memory") == 0) return GC_MEMORY;
+  if (strcmp(name, "stress") == 0) return GC_STRESS;
+  usage();
+  return GC_LATENCY;
+}
+
+static size_t parse_heap_limit(const char *megabytes) {
+  const long limit = atol(megabytes);
+  if (limit <= 0) usage();
+  return (size_t)limit * 1024 * 1024;
+}
+
 int main(const int argc, char *argv[]) {
   init_vm();
 
-  if (argc == 1) {
+  // Environment first, so the command line wins
+  const char *mode = getenv("NEZNAYU_GC_MODE");
+  const char *heap_limit = getenv("NEZNAYU_HEAP_LIMIT");
+  long budget = -1;
+  bool compact = false;
+  const char *image = NULL;
+  const char *saved_image = NULL;
+
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; ++arg) {
+    // Bytecode flavour for this run, default is set by REGISTER_OPS in common.h
+    if (strcmp(argv[arg], "--stack") == 0) {
+      vm.register_ops = false;
+    } else if (strcmp(argv[arg], "--register") == 0) {
+      vm.register_ops = true;
+    } else if (strcmp(argv[arg], "--max-frames") == 0 && arg + 1 < argc) {
+      // Call depth before "Stack overflow.", frames are allocated lazily
+      vm.frame_limit = atoi(argv[++arg]);
+      if (vm.frame_limit <= 0) usage();
+    } else if (strcmp(argv[arg], "--gc-mode") == 0 && arg + 1 < argc) {
+      mode = argv[++arg];
+    } else if (strcmp(argv[arg], "--gc-budget") == 0 && arg + 1 < argc) {
+      // Longest GC slice in microseconds, 0 makes major GC stop-the-world
+      budget = atol(argv[++arg]);
+      if (budget < 0) usage();
+    } else if (strcmp(argv[arg], "--gc-threads") == 0 && arg + 1 < argc) {
+      vm.gc_threads = atoi(argv[++arg]);
+      if (vm.gc_threads <= 0) usage();
+    } else if (strcmp(argv[arg], "--heap-limit") == 0 && arg + 1 < argc) {
+      heap_limit = argv[++arg];
+    } else if (strcmp(argv[arg], "--gc-compact") == 0) {
+      // Moves objects out of sparse pages after major cycles, default of memory mode
+      compact = true;
+    } else if (strcmp(argv[arg], "--image") == 0 && arg + 1 < argc) {
+      image = argv[++arg];
+    } else if (strcmp(argv[arg], "--save-image") == 0 && arg + 1 < argc) {
+      saved_image = argv[++arg];
+    } else {
+      usage();
+    }
+  }
+
+  // Limit before the mode, the first trigger is capped by it. Explicit budget beats the mode
+  if (heap_limit != NULL) vm.gc_heap_limit = parse_heap_limit(heap_limit);
+  if (mode != NULL) {
+    set_gc_mode(parse_gc_mode(mode));
+  } else if (vm.gc_heap_limit != 0) {
+    set_gc_mode(vm.gc_mode);
+  }
+  if (budget >= 0) vm.gc_budget_ns = (uint64_t)budget * 1000;
+  if (compact) vm.gc_compact = true;
+
+  // Prelude compiled and run by an earlier start, see image.h
+  if (image != NULL) load_image(image);
+
+  if (saved_image != NULL) {
+    if (arg + 1 != argc) usage();
+    run_file(argv[arg]);
+    save_image(saved_image);
+  } else if (arg == argc) {
     repl();
-  } else if (argc == 2) {
-    run_file(argv[1]);
+  } else if (arg + 1 == argc) {
+    run_file(argv[arg]);
   } else {
-    fprintf(stderr, "Usage: NeZnayu [path]\n");
-    exit(64);
+    usage();
   }
 
   free_vm();
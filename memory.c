@@ -1,15 +1,58 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef PARALLEL_MARK
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+#define GC_CLOCK_INTERVAL 64    // Objects between two deadline checks in a slice
+#define GC_NURSERY_MAX_SCALE 8  // Nursery grows up to this times the size of the mode
+// Major cycle asks for compaction when it can give back this many pages,
+// and at least 1/COMPACT_SPARE_SHARE of them
+#define COMPACT_MIN_PAGES 8
+#define COMPACT_SPARE_SHARE 4
+
+typedef struct {
+  uint64_t budget_us;
+  size_t nursery_size;
+  size_t first_gc;      // Heap size of the first major cycle
+  double min_growth;
+  double max_growth;
+  double gc_share;      // Wanted part of the run time spent in pauses
+  bool compact;         // Evacuate sparse pages after a major cycle, see compact_heap()
+} GcPolicy;
+
+static const GcPolicy policies[] = {
+  [GC_THROUGHPUT] = {0,            1024 * 1024, 4 * 1024 * 1024, 2.0, 8.0, 0.05, false},
+  [GC_LATENCY]    = {GC_BUDGET_US, 256 * 1024,  1024 * 1024,     2.0, 4.0, 0.10, false},
+  [GC_MEMORY]     = {0,            64 * 1024,   256 * 1024,      1.2, 1.5, 0.25, true},
+  [GC_STRESS]     = {GC_BUDGET_US, 256 * 1024,  1024 * 1024,     2.0, 4.0, 0.10, true},
+};
+
+static void gc_poll();
+
+// Where mark_object() puts gray objects: vm.gray, or the stack of this marker thread
+static _Thread_local GrayStack *gray = &vm.gray;
+
+#ifdef PARALLEL_MARK
+static bool marking_in_parallel = false;
+#endif
 
 void *reallocate(void *pointer, const size_t old_size, const size_t new_size) {
   // TODO Ahem? I think this is bad idea, to sub two unsigned values
@@ -19,14 +62,7 @@ void *reallocate(void *pointer, const size_t old_size, const size_t new_size) {
   // printf("vm bytes = %lu\n\n", vm.bytes_allocated);
 
   if (new_size > old_size) {
-// Bad for performance, but good for finding bugs
-#ifdef DEBUG_STRESS_GC
-    collect_garbage();
-#endif
-
-    if (vm.bytes_allocated > vm.next_gc) {
-      collect_garbage();
-    }
+    gc_poll();
   }
   
   if (new_size == 0) {
@@ -39,9 +75,43 @@ void *reallocate(void *pointer, const size_t old_size, const size_t new_size) {
   return result;
 }
 
+// Same accounting as reallocate(), but the memory is a cell in a heap page
+Obj *allocate_cell(const size_t size) {
+  vm.bytes_allocated += heap_footprint(&vm.heap, size);
+  gc_poll();
+  return heap_allocate(&vm.heap, size);
+}
+
+// Can be any other data structure instead of gray stack.
+// Use this, because it easy to implement
+static void gray_push(GrayStack *stack, Obj *object) {
+  if (stack->capacity < stack->count + 1) {
+    stack->capacity = GROW_CAPACITY(stack->capacity);
+    stack->items = (Obj**)realloc(stack->items, sizeof(Obj*) * stack->capacity);
+
+    if (stack->items == NULL) exit(1);
+  }
+
+  stack->items[stack->count++] = object;
+}
+
 void mark_object(Obj *object) {
+  if (object == NULL) return;
+
+#ifdef PARALLEL_MARK
+  // Atomic mark bit: exactly one marker wins the object and makes it gray
+  if (marking_in_parallel) {
+    if (__atomic_load_n(&object->mark, __ATOMIC_RELAXED) == vm.mark_epoch ||
+        __atomic_exchange_n(&object->mark, vm.mark_epoch, __ATOMIC_RELAXED) == vm.mark_epoch) {
+      return;
+    }
+    gray_push(gray, object);
+    return;
+  }
+#endif
+
   // Because can have cycle of gray objects
-  if (object == NULL || object->is_marked) return;
+  if (IS_MARKED(object)) return;
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
@@ -49,26 +119,43 @@ void mark_object(Obj *object) {
   printf("\n");
 #endif
 
-  // Tricolor abstraction. We need it for multithreading approach in future...
-  // If white, is_marked == false, if black, then true, if gray, then true and add to worklist
-  object->is_marked = true;
-
-  // Can be any other data structure instead of gray stack.
-  // Use this, because it easy to implement
-  if (vm.gray_capacity < vm.gray_count + 1) {
-    vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-    vm.gray_stack = (Obj**)realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
-    
-    if (vm.gray_stack == NULL) exit(1);
-  }
-  
-  vm.gray_stack[vm.gray_count++] = object;
+  // Tricolor abstraction. Major cycle is incremental, so the colors outlive one call.
+  // If white, not marked, if black, then marked, if gray, then marked and in the worklist
+  object->mark = vm.mark_epoch;
+  gray_push(gray, object);
 }
 
 void mark_value(Value value) {
   if (IS_OBJ(value)) mark_object(AS_OBJ(value));
 }
 
+// Raw realloc like the gray stack, barrier must never start GC.
+// While marking, black object can't point to white one: the target becomes gray.
+// Otherwise it is an old object with a young reference, minor GC scans it like a root
+void write_barrier_slow(Obj *object, Obj *target) {
+  if (vm.gc_phase == GC_MARK) {
+    mark_object(target);
+    return;
+  }
+
+  if (vm.remembered_capacity < vm.remembered_count + 1) {
+    vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+    vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.remembered_capacity);
+
+    if (vm.remembered == NULL) exit(1);
+  }
+
+  object->is_remembered = true;
+  vm.remembered[vm.remembered_count++] = object;
+}
+
+static void forget_remembered() {
+  for (int i = 0; i < vm.remembered_count; ++i) {
+    vm.remembered[i]->is_remembered = false;
+  }
+  vm.remembered_count = 0;
+}
+
 static void mark_array(ValueArray *array) {
   for (int i = 0; i < array->length; ++i) {
     mark_value(array->values[i]);
@@ -104,12 +191,42 @@ static void blacken_object(Obj *object) {
       ObjFunction *function = (ObjFunction*)object;
       mark_object((Obj*)function->name);
       mark_array(&function->chunk.constants);
+
+      for (int i = 0; i < function->chunk.cache_count; ++i) {
+        const InlineCache *cache = &function->chunk.caches[i];
+        for (int j = 0; j < cache->count; ++j) {
+          mark_object(cache->entries[j].key);
+          mark_value(cache->entries[j].value);
+        }
+      }
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance*)object;
       mark_object((Obj*)instance->actor);
-      mark_table(&instance->fields);
+      if (instance->shape == NULL) {
+        mark_table(instance->dict);
+        break;
+      }
+
+      mark_object((Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->slot_count; ++i) {
+        mark_value(instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape*)object;
+      mark_object((Obj*)shape->parent);
+      mark_object((Obj*)shape->name);
+      mark_table(&shape->transitions);
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope *rope = (ObjRope*)object;
+      mark_object(rope->left);
+      mark_object(rope->right);
+      mark_object((Obj*)rope->flat);
       break;
     }
     case OBJ_UPVALUE:
@@ -123,49 +240,63 @@ static void blacken_object(Obj *object) {
   }
 }
 
-static void free_object(Obj *object) {
+static size_t object_size(const Obj *object) {
+  switch (object->type) {
+    case OBJ_ACTOR: return sizeof(ObjActor);
+    case OBJ_CLOSURE: return sizeof(ObjClosure);
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_INSTANCE:
+      return sizeof(ObjInstance) + sizeof(Value) * ((const ObjInstance*)object)->inline_capacity;
+    case OBJ_SHAPE: return sizeof(ObjShape);
+    case OBJ_NATIVE: return sizeof(ObjNative);
+    case OBJ_ROPE: return sizeof(ObjRope);
+    case OBJ_STRING: return sizeof(ObjString) + ((const ObjString*)object)->length + 1;
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+  }
+  return 0;
+}
+
+// Releases what the object owns, the cell itself goes back to its page
+void free_object(Obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
   switch (object->type) {
-    case OBJ_ACTOR: {
-      ObjActor *actor = (ObjActor*)object;
-      free_table(&actor->messages);
-      FREE(ObjActor, object);
+    case OBJ_ACTOR:
+      free_table(&((ObjActor*)object)->messages);
       break;
-    }
     case OBJ_CLOSURE: {
       const ObjClosure *closure = (ObjClosure*)object;
       // TODO need to uncomment, but there is a bug...
       FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-      FREE(ObjClosure, object);
       break;
     }
-    case OBJ_FUNCTION: {
-      ObjFunction *function = (ObjFunction*)object;
-      free_chunk(&function->chunk);
-      FREE(ObjFunction, object);
+    case OBJ_FUNCTION:
+      free_chunk(&((ObjFunction*)object)->chunk);
       break;
-    }
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance*)object;
-      free_table(&instance->fields);
-      FREE(ObjInstance, object);
+      if (instance->shape == NULL) {
+        free_table(instance->dict);
+        FREE(Table, instance->dict);
+      } else if (instance->fields != instance->inline_fields) {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+      }
       break;
     }
-    case OBJ_NATIVE:
-      FREE(ObjNative, object);
-      break;
-    case OBJ_STRING: {
-      ObjString *string = (ObjString*)object;
-      reallocate(string, sizeof(ObjString) +  string->length + 1, 0);
+    case OBJ_SHAPE:
+      free_table(&((ObjShape*)object)->transitions);
       break;
-    }
+
+    // Nothing of their own
+    case OBJ_NATIVE:
+    case OBJ_ROPE:
+    case OBJ_STRING:
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
       break;
   }
+  vm.bytes_allocated -= heap_footprint(&vm.heap, object_size(object));
 }
 
 static void mark_roots() {
@@ -184,67 +315,621 @@ static void mark_roots() {
   mark_globals(&vm.globals);
   mark_compiler_roots();
   mark_object((Obj*)vm.init_string);
+  mark_object((Obj*)vm.empty_shape);
 }
 
-static void trace_references() {
-  while (vm.gray_count > 0) {
-    Obj *object = vm.gray_stack[--vm.gray_count];
-    blacken_object(object);
+static uint64_t clock_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void record_pause(const uint64_t ns) {
+  GcStats *stats = &vm.gc_stats;
+  ++stats->pause_count;
+  stats->pause_total_ns += ns;
+  if (stats->pause_max_ns < ns) stats->pause_max_ns = ns;
+
+  const uint64_t us = ns / 1000;
+  uint64_t bucket = us < 1024 ? us : 1024 + us / 1000;
+  if (bucket >= GC_PAUSE_BUCKETS) bucket = GC_PAUSE_BUCKETS - 1;
+  ++stats->pauses[bucket];
+}
+
+// Upper bound of the bucket, so the answer is never better than reality
+double gc_pause_percentile(const double percentile) {
+  const GcStats *stats = &vm.gc_stats;
+  const uint64_t rank = (uint64_t)(stats->pause_count * percentile / 100.0);
+  uint64_t seen = 0;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+    seen += stats->pauses[i];
+    if (seen > rank) return i < 1024 ? i + 1 : (i - 1024 + 1) * 1000.0;
   }
+  return (double)stats->pause_max_ns / 1000.0;
 }
 
-// Common "delete node from singly linked list" algorithm
-static void sweep() {
-  Obj *previous = NULL;
-  Obj *object = vm.objects;
+#ifdef PARALLEL_MARK
+#define GC_MAX_THREADS 64
+#define GC_PARALLEL_MIN 64    // Gray objects before other markers are woken up
+#define GC_SHARE_INTERVAL 32  // Objects between two looks for idle markers
+
+// Owner works on its private stack and moves the bottom half of it to shared,
+// when somebody is idle. Bottom of a DFS stack holds the biggest subgraphs
+typedef struct {
+  GrayStack stack;
+  GrayStack shared;  // Under lock, the only place thieves take from
+  pthread_mutex_t lock;
+  pthread_t thread;
+} Marker;
+
+static Marker markers[GC_MAX_THREADS];
+static int marker_count = 0;  // Marker 0 is the mutator thread itself
+static int idle_markers = 0;  // Atomic
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static uint64_t pool_generation = 0;  // Bumped for every parallel mark
+static int pool_running = 0;          // Helper threads still marking
+static bool pool_exit = false;
+
+// shared.count is written under lock, but thieves peek at it without one
+static void share_work(Marker *self) {
+  const int half = self->stack.count / 2;
+  pthread_mutex_lock(&self->lock);
+  GrayStack *shared = &self->shared;
+  if (shared->count == 0) {
+    if (shared->capacity < half) {
+      shared->capacity = half;
+      shared->items = (Obj**)realloc(shared->items, sizeof(Obj*) * half);
+      if (shared->items == NULL) exit(1);
+    }
+    memcpy(shared->items, self->stack.items, sizeof(Obj*) * half);
+    __atomic_store_n(&shared->count, half, __ATOMIC_RELAXED);
 
-  while (object != NULL) {
-    if (object->is_marked) {
-      object->is_marked = false;
-      previous = object;
-      object = object->next;
-      continue;
+    self->stack.count -= half;
+    memmove(self->stack.items, self->stack.items + half, sizeof(Obj*) * self->stack.count);
+  }
+  pthread_mutex_unlock(&self->lock);
+}
+
+// Half of the first non-empty shared stack, own one is checked first
+static bool take_work(Marker *self) {
+  const int index = (int)(self - markers);
+  for (int i = 0; i < marker_count; ++i) {
+    Marker *victim = &markers[(index + i) % marker_count];
+    if (__atomic_load_n(&victim->shared.count, __ATOMIC_RELAXED) == 0) continue;
+
+    pthread_mutex_lock(&victim->lock);
+    const int count = victim->shared.count;
+    const int take = (count + 1) / 2;
+    for (int j = 1; j <= take; ++j) {
+      gray_push(&self->stack, victim->shared.items[count - j]);
     }
+    __atomic_store_n(&victim->shared.count, count - take, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&victim->lock);
+    if (take > 0) return true;
+  }
+  return false;
+}
 
-    Obj *unreached = object;
-    object = object->next;
-    if (previous != NULL) {
-      previous->next = object;
-    } else {
-      vm.objects = object;
+// Done when every marker is idle: idle one has checked its own shared stack,
+// and nobody else fills it, so no work is left anywhere
+static void run_marker(Marker *self) {
+  int work = 0;
+  for (;;) {
+    while (self->stack.count > 0) {
+      blacken_object(self->stack.items[--self->stack.count]);
+
+      if (++work % GC_SHARE_INTERVAL == 0 && self->stack.count > 1 &&
+          __atomic_load_n(&idle_markers, __ATOMIC_RELAXED) > 0) {
+        share_work(self);
+      }
     }
+    if (take_work(self)) continue;
 
-    free_object(unreached);
+    __atomic_add_fetch(&idle_markers, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&idle_markers, __ATOMIC_SEQ_CST) == marker_count) return;
+      if (take_work(self)) break;
+      sched_yield();
+    }
+    __atomic_sub_fetch(&idle_markers, 1, __ATOMIC_SEQ_CST);
   }
 }
 
-void collect_garbage() {
-#ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+static void *marker_thread(void *arg) {
+  Marker *self = arg;
+  gray = &self->stack;
+
+  uint64_t seen = 0;
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (pool_generation == seen && !pool_exit) pthread_cond_wait(&pool_wake, &pool_lock);
+    if (pool_exit) break;
+    seen = pool_generation;
+    pthread_mutex_unlock(&pool_lock);
+
+    run_marker(self);
+
+    pthread_mutex_lock(&pool_lock);
+    if (--pool_running == 0) pthread_cond_signal(&pool_done);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+// Threads start on the first parallel mark, so --gc-threads is already parsed
+static void start_markers() {
+  int count = vm.gc_threads;
+  if (count == 0) count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (count < 1) count = 1;
+  if (count > GC_MAX_THREADS) count = GC_MAX_THREADS;
+
+  marker_count = count;
+  for (int i = 0; i < count; ++i) {
+    Marker *marker = &markers[i];
+    marker->stack = marker->shared = (GrayStack){NULL, 0, 0};
+    pthread_mutex_init(&marker->lock, NULL);
+    if (i > 0 && pthread_create(&marker->thread, NULL, marker_thread, marker) != 0) {
+      marker_count = i;  // Fine, just less help
+      break;
+    }
+  }
+}
+
+static void stop_markers() {
+  pthread_mutex_lock(&pool_lock);
+  pool_exit = true;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+
+  for (int i = 0; i < marker_count; ++i) {
+    if (i > 0) pthread_join(markers[i].thread, NULL);
+    pthread_mutex_destroy(&markers[i].lock);
+    free(markers[i].stack.items);
+    free(markers[i].shared.items);
+  }
+  marker_count = 0;
+}
+
+// Mutator is stopped, vm.gray is dealt out to the markers and everyone drains and steals
+static void parallel_trace() {
+  for (int i = 0; i < vm.gray.count; ++i) {
+    gray_push(&markers[i % marker_count].stack, vm.gray.items[i]);
+  }
+  vm.gray.count = 0;
+  idle_markers = 0;
+  marking_in_parallel = true;
+
+  pthread_mutex_lock(&pool_lock);
+  pool_running = marker_count - 1;
+  ++pool_generation;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+
+  gray = &markers[0].stack;
+  run_marker(&markers[0]);
+  gray = &vm.gray;
+
+  pthread_mutex_lock(&pool_lock);
+  while (pool_running > 0) pthread_cond_wait(&pool_done, &pool_lock);
+  pthread_mutex_unlock(&pool_lock);
+  marking_in_parallel = false;
+}
+#endif
+
+// Gray stack is drained until deadline, 0 means no deadline. True if nothing is left.
+// Without deadline the mutator just waits, so big enough work goes to all markers
+static bool trace_references(const uint64_t deadline) {
+  int work = 0;
+  while (vm.gray.count > 0) {
+#ifdef PARALLEL_MARK
+    if (deadline == 0 && vm.gray.count >= GC_PARALLEL_MIN && vm.gc_threads != 1) {
+      if (marker_count == 0) start_markers();
+      if (marker_count > 1) {
+        parallel_trace();
+        return true;
+      }
+    }
+#endif
+
+    Obj *object = vm.gray.items[--vm.gray.count];
+    blacken_object(object);
+
+    if (deadline != 0 && ++work % GC_CLOCK_INTERVAL == 0 && clock_ns() > deadline) {
+      return vm.gray.count == 0;
+    }
+  }
+  return true;
+}
+
+// Cost of minor GC is marking the survivors. When most of the nursery survives,
+// objects don't get enough time to die in it, so it grows
+static void adapt_nursery(const size_t before) {
+  if (vm.gc_mode == GC_STRESS || before <= vm.gc_minor_base) return;
+
+  const size_t survived = vm.bytes_allocated > vm.gc_minor_base
+    ? vm.bytes_allocated - vm.gc_minor_base : 0;
+  const double survival = (double)survived / (double)(before - vm.gc_minor_base);
+  const size_t base = policies[vm.gc_mode].nursery_size;
+
+  if (survival > 0.5 && vm.gc_nursery_size < base * GC_NURSERY_MAX_SCALE) {
+    vm.gc_nursery_size *= 2;
+  } else if (survival < 0.1 && vm.gc_nursery_size > base) {
+    vm.gc_nursery_size /= 2;
+  }
+}
+
+// Minor GC. Old objects stay marked between collections (sticky mark bits),
+// so marking stops at them and only the nursery is traced. Young objects reachable
+// only from old ones are found through the remembered set.
+// Nothing moves: C code holds raw Obj* everywhere, so copying survivors is not an option
+void collect_nursery() {
   const size_t before = vm.bytes_allocated;
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
 #endif
 
   mark_roots();
-  trace_references();
+  for (int i = 0; i < vm.remembered_count; ++i) {
+    blacken_object(vm.remembered[i]);
+  }
+  forget_remembered();
+  trace_references(0);
   table_remove_white(&vm.strings);
-  sweep();
+  sweep_young(&vm.heap);
 
-  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+  ++vm.gc_stats.minor_count;
+  adapt_nursery(before);
+  vm.gc_minor_base = vm.bytes_allocated;
+  vm.next_minor_gc = vm.bytes_allocated + vm.gc_nursery_size;
 
 #ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
+  printf("-- minor gc end\n");
   printf("    collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+         before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_minor_gc);
 #endif
 }
 
-void free_objects() {
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    Obj *next = object->next;
-    free_object(object);
-    object = next;
+static size_t heap_target(const double growth) {
+  const size_t target = (size_t)((double)vm.bytes_allocated * growth);
+  return vm.gc_heap_limit != 0 && target > vm.gc_heap_limit ? vm.gc_heap_limit : target;
+}
+
+// Pauses took more of the run time than the mode wants: the heap grows more
+// before the next cycle. Cheap collections bring it back to the minimum
+static void adapt_growth() {
+  const uint64_t now = clock_ns();
+  const GcPolicy *policy = &policies[vm.gc_mode];
+
+  if (now > vm.gc_cycle_end_ns) {
+    const double share = (double)(vm.gc_stats.pause_total_ns - vm.gc_cycle_pause_ns) /
+                         (double)(now - vm.gc_cycle_end_ns);
+    double ratio = share / policy->gc_share;
+    if (ratio < 0.5) ratio = 0.5;
+    if (ratio > 2.0) ratio = 2.0;
+
+    vm.gc_growth = 1.0 + (vm.gc_growth - 1.0) * ratio;
+    if (vm.gc_growth < policy->min_growth) vm.gc_growth = policy->min_growth;
+    if (vm.gc_growth > policy->max_growth) vm.gc_growth = policy->max_growth;
+  }
+  vm.gc_cycle_end_ns = now;
+  vm.gc_cycle_pause_ns = vm.gc_stats.pause_total_ns;
+}
+
+// Enough of the heap is in sparse pages to pay for moving
+static bool worth_compacting() {
+  const int spare = heap_spare_pages(&vm.heap);
+  return spare >= COMPACT_MIN_PAGES && spare * COMPACT_SPARE_SHARE >= vm.heap.page_count;
+}
+
+// Heap size is known only when every page is swept
+static void finish_cycle() {
+  vm.gc_phase = GC_IDLE;
+  ++vm.gc_stats.major_count;
+  adapt_growth();
+  vm.next_gc = heap_target(vm.gc_growth);
+  vm.next_minor_gc = vm.bytes_allocated + vm.gc_nursery_size;
+
+  if (vm.gc_compact && worth_compacting()) vm.compact_pending = true;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("    heap is %zu bytes, next at %zu\n", vm.bytes_allocated, vm.next_gc);
+#endif
+}
+
+static void finish_sweep() {
+  while (sweep_pending(&vm.heap));
+  finish_cycle();
+}
+
+// Major cycle: nursery goes to the old generation first, so after the flip
+// of mark_epoch every object is white. Objects allocated from now on are black.
+// Dead objects of the last cycle must be gone before that, or the flip revives them
+static void start_cycle() {
+  if (vm.gc_phase == GC_SWEEP) finish_sweep();
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+#endif
+
+  collect_nursery();
+  forget_remembered();
+  vm.mark_epoch = !vm.mark_epoch;
+  vm.gc_phase = GC_MARK;
+  vm.gc_hard_limit = heap_target(vm.gc_growth);
+  vm.next_gc_step = vm.bytes_allocated + GC_STEP_SIZE;
+  mark_roots();
+}
+
+// Roots are not behind write barriers, so they are scanned once more in the last slice.
+// Nursery is all black by now. Pages are swept lazily afterwards, minor GC may run meanwhile
+static void finish_mark() {
+  mark_roots();
+  trace_references(0);
+  table_remove_white(&vm.strings);
+  start_lazy_sweep(&vm.heap);
+
+  vm.gc_phase = GC_SWEEP;
+  // Sweep must be over by then, start_cycle() finishes it otherwise
+  vm.next_gc = vm.gc_hard_limit;
+  vm.next_minor_gc = vm.bytes_allocated + vm.gc_nursery_size;
+  vm.next_gc_step = vm.bytes_allocated + GC_STEP_SIZE;
+}
+
+// One bounded piece of the major cycle. Sweep does at least one page
+static void gc_step(const uint64_t deadline) {
+  if (vm.gc_phase == GC_MARK && trace_references(deadline)) {
+    finish_mark();
+  } else if (vm.gc_phase == GC_SWEEP) {
+    while (sweep_pending(&vm.heap)) {
+      if (clock_ns() > deadline) break;
+    }
+    if (vm.heap.pending_pages == 0) finish_cycle();
+  }
+  vm.next_gc_step = vm.bytes_allocated + GC_STEP_SIZE;
+}
+
+// Stop-the-world major GC, finishes the running cycle if there is one
+void collect_garbage() {
+  if (vm.gc_phase != GC_MARK) start_cycle();
+  trace_references(0);
+  finish_mark();
+  finish_sweep();
+}
+
+// gc() of the language. Same collection, but the program asked for it, so it is a pause too.
+// Heap is compacted at the next safe point in every mode, natives are not one
+void force_collection() {
+  const uint64_t start = clock_ns();
+  collect_garbage();
+  if (worth_compacting()) vm.compact_pending = true;
+  record_pause(clock_ns() - start);
+}
+
+static Obj *forward(Obj *object) {
+  return object != NULL && object->mark == MARK_FORWARDED ? object->next : object;
+}
+
+static void forward_value(Value *value) {
+  if (IS_OBJ(*value)) *value = OBJ_VAL(forward(AS_OBJ(*value)));
+}
+
+static void forward_table(Table *table) {
+  for (Table *part = table; part != NULL; part = part->old) {
+    for (int i = 0; i < part->capacity; ++i) {
+      Entry *entry = &part->entries[i];
+      entry->key = (ObjString*)forward((Obj*)entry->key);
+      forward_value(&entry->value);
+    }
+  }
+}
+
+// Pointers into the object itself, called by heap_evacuate() right after the copy
+static void object_moved(Obj *from, Obj *to) {
+  if (to->type == OBJ_INSTANCE) {
+    ObjInstance *instance = (ObjInstance*)to;
+    if (instance->shape != NULL && instance->fields == ((ObjInstance*)from)->inline_fields) {
+      instance->fields = instance->inline_fields;
+    }
+  } else if (to->type == OBJ_UPVALUE) {
+    ObjUpvalue *upvalue = (ObjUpvalue*)to;
+    if (upvalue->location == &((ObjUpvalue*)from)->closed) upvalue->location = &upvalue->closed;
+  }
+}
+
+// Same references blacken_object() follows
+static void forward_object(Obj *object) {
+  switch (object->type) {
+    case OBJ_ACTOR: {
+      ObjActor *actor = (ObjActor*)object;
+      actor->name = (ObjString*)forward((Obj*)actor->name);
+      forward_table(&actor->messages);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = (ObjClosure*)object;
+      closure->function = (ObjFunction*)forward((Obj*)closure->function);
+      for (int i = 0; i < closure->upvalue_count; ++i) {
+        closure->upvalues[i] = (ObjUpvalue*)forward((Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = (ObjFunction*)object;
+      function->name = (ObjString*)forward((Obj*)function->name);
+      for (int i = 0; i < function->chunk.constants.length; ++i) {
+        forward_value(&function->chunk.constants.values[i]);
+      }
+      for (int i = 0; i < function->chunk.cache_count; ++i) {
+        InlineCache *cache = &function->chunk.caches[i];
+        for (int j = 0; j < cache->count; ++j) {
+          cache->entries[j].key = forward(cache->entries[j].key);
+          forward_value(&cache->entries[j].value);
+        }
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = (ObjInstance*)object;
+      instance->actor = (ObjActor*)forward((Obj*)instance->actor);
+      if (instance->shape == NULL) {
+        forward_table(instance->dict);
+        break;
+      }
+
+      instance->shape = (ObjShape*)forward((Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->slot_count; ++i) {
+        forward_value(&instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape*)object;
+      shape->parent = (ObjShape*)forward((Obj*)shape->parent);
+      shape->name = (ObjString*)forward((Obj*)shape->name);
+      forward_table(&shape->transitions);
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope *rope = (ObjRope*)object;
+      rope->left = forward(rope->left);
+      rope->right = forward(rope->right);
+      rope->flat = (ObjString*)forward((Obj*)rope->flat);
+      break;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue *upvalue = (ObjUpvalue*)object;
+      forward_value(&upvalue->closed);
+      upvalue->next = (ObjUpvalue*)forward((Obj*)upvalue->next);
+      break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+// Everything mark_roots() reaches, the weak intern table and the remembered set
+static void forward_roots() {
+  for (Value *slot = vm.stack; slot < vm.stack_top; ++slot) {
+    forward_value(slot);
+  }
+
+  for (int i = 0; i < vm.frame_count; ++i) {
+    vm.frames[i].closure = (ObjClosure*)forward((Obj*)vm.frames[i].closure);
+  }
+  vm.open_upvalues = (ObjUpvalue*)forward((Obj*)vm.open_upvalues);
+
+  for (int i = 0; i < vm.globals.length; ++i) {
+    GlobalVar *var = &vm.globals.values[i];
+    var->name = (const ObjString*)forward((Obj*)var->name);
+    forward_value(&var->value);
+  }
+  forward_table(&vm.globals.slots);
+  forward_table(&vm.strings);
+  vm.init_string = (ObjString*)forward((Obj*)vm.init_string);
+  vm.empty_shape = (ObjShape*)forward((Obj*)vm.empty_shape);
+
+  for (int i = 0; i < vm.remembered_count; ++i) {
+    vm.remembered[i] = forward(vm.remembered[i]);
   }
+}
+
+// Live objects of sparse pages slide into fuller pages of their size class, and the
+// emptied pages go back to the system. Only at a safe point of run(): no C code
+// holds an object pointer in a local there
+void compact_heap() {
+  if (vm.gc_phase == GC_MARK) {
+    vm.compact_pending = false;  // Next cycle asks again
+    return;
+  }
+
+  const uint64_t start = clock_ns();
+  if (vm.gc_phase == GC_SWEEP) finish_sweep();
+  vm.compact_pending = false;
+  // Nursery goes first: then every cell is live, no page is active
+  // and the allocator holds no free list
+  collect_nursery();
+
+  if (heap_evacuate(&vm.heap, object_moved) > 0) {
+    forward_roots();
+    heap_visit(&vm.heap, forward_object);
+    heap_release_evacuated(&vm.heap);
+#ifdef __GLIBC__
+    malloc_trim(0);  // Freed pages sit in the middle of the malloc arena
+#endif
+    ++vm.gc_stats.compact_count;
+  }
+  record_pause(clock_ns() - start);
+}
 
-  free(vm.gray_stack);
+void set_gc_mode(const GcMode mode) {
+  const GcPolicy *policy = &policies[mode];
+  vm.gc_mode = mode;
+  vm.gc_budget_ns = policy->budget_us * 1000;
+  vm.gc_compact = policy->compact;
+  vm.gc_nursery_size = policy->nursery_size;
+  vm.gc_growth = policy->min_growth;
+  vm.gc_minor_base = vm.bytes_allocated;
+  vm.next_minor_gc = vm.bytes_allocated + vm.gc_nursery_size;
+  vm.next_gc = vm.bytes_allocated + policy->first_gc;
+  if (vm.gc_heap_limit != 0 && vm.next_gc > vm.gc_heap_limit) vm.next_gc = vm.gc_heap_limit;
+  vm.gc_cycle_end_ns = clock_ns();
+  vm.gc_cycle_pause_ns = vm.gc_stats.pause_total_ns;
+}
+
+// Full collection did not get the heap under the ceiling
+static void heap_limit_exceeded() {
+  fprintf(stderr, "Out of memory: heap limit of %zu bytes exceeded.\n", vm.gc_heap_limit);
+  exit(70);
+}
+
+// Decides what the collector does on this allocation. Mutator waits for all of it,
+// so every piece of work is one pause in the stats
+static void gc_poll() {
+  // Bad for performance, but good for finding bugs. Minor GC or a tiny slice
+  // on every allocation, because a missing write barrier is the easiest bug to make now
+  const bool stress = vm.gc_mode == GC_STRESS;
+  size_t trigger = vm.gc_phase == GC_MARK ? vm.next_gc_step
+    : vm.next_minor_gc < vm.next_gc ? vm.next_minor_gc : vm.next_gc;
+  if (vm.gc_phase == GC_SWEEP && vm.next_gc_step < trigger) trigger = vm.next_gc_step;
+  if ((!stress && vm.bytes_allocated <= trigger) || vm.gc_paused) return;
+
+  const uint64_t start = clock_ns();
+  if (vm.gc_heap_limit != 0 && vm.bytes_allocated > vm.gc_heap_limit) {
+    collect_garbage();
+    if (vm.bytes_allocated > vm.gc_heap_limit) heap_limit_exceeded();
+  } else if (vm.gc_phase == GC_MARK) {
+    if (vm.bytes_allocated > vm.gc_hard_limit) {
+      collect_garbage();
+    } else if (stress || vm.bytes_allocated > vm.next_gc_step) {
+      gc_step(stress ? start + 1 : start + vm.gc_budget_ns);
+    } else {
+      return;
+    }
+  } else if (vm.bytes_allocated > vm.next_gc) {
+    start_cycle();
+    if (vm.gc_budget_ns == 0) collect_garbage();
+  } else if (stress || vm.bytes_allocated > vm.next_minor_gc) {
+    collect_nursery();
+    if (stress && vm.gc_phase == GC_SWEEP) gc_step(start + 1);
+  } else if (vm.gc_phase == GC_SWEEP && vm.bytes_allocated > vm.next_gc_step) {
+    gc_step(start + vm.gc_budget_ns);
+  } else {
+    return;
+  }
+  record_pause(clock_ns() - start);
+}
+
+void free_objects() {
+  free_heap(&vm.heap);
+
+#ifdef PARALLEL_MARK
+  if (marker_count > 0) stop_markers();
+#endif
+  free(vm.gray.items);
+  free(vm.remembered);
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 // We used reallocate everywhere,
 // because later it will be convenient to keep track of uncleared memory
@@ -21,11 +22,35 @@
 #define FREE_ARRAY(type, pointer, old_size) \
   reallocate(pointer, sizeof(type) * (old_size), 0)
 
+// Bytes allocated between two slices of a major cycle
+#define GC_STEP_SIZE (64 * 1024)
+// Default longest slice in microseconds, see --gc-budget
+#define GC_BUDGET_US 500
+
+#define IS_MARKED(object) ((object)->mark == vm.mark_epoch)
+
 // This function take care of allocating, freeing memory and changing the size
 void *reallocate(void *pointer, size_t old_size, size_t new_size);
+Obj *allocate_cell(size_t size);
+void free_object(Obj *object);
 void mark_object(Obj *object);
 void mark_value(Value value);
+void write_barrier_slow(Obj *object, Obj *target);
+void collect_nursery();
 void collect_garbage();
+void force_collection();
+void compact_heap();
+void set_gc_mode(GcMode mode);
 void free_objects();
+double gc_pause_percentile(double percentile);  // In microseconds
+
+// Call after storing value into object. Marked object got an unmarked reference:
+// old object pointing into the nursery, or black pointing to white while a major cycle marks
+static inline void write_barrier(Obj *object, const Value value) {
+  if (IS_MARKED(object) && !object->is_remembered &&
+      IS_OBJ(value) && !IS_MARKED(AS_OBJ(value))) {
+    write_barrier_slow(object, AS_OBJ(value));
+  }
+}
 
 #endif // PL_MEMORY_H
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+
+// TODO
+// 1. Add input stream with (scanf for example)
+// 2. Add input/output streams (with files)
+static NativeStatus clock_native(const Value *args, Value *result) {
+  (void)args;
+  *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return NATIVE_OK;
+}
+
+static NativeStatus sqrt_native(const Value *args, Value *result) {
+  // TODO check with actors or funcs
+  if (IS_OBJ(args[0])) return NATIVE_EXPECT_NUMBER;
+
+  if (IS_BOOL(args[0])) {
+    *result = NUMBER_VAL(sqrt(AS_BOOL(args[0])));
+  } else if (IS_NIL(args[0])) {
+    *result = NUMBER_VAL(0);
+  } else {
+    *result = NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+  }
+  return NATIVE_OK;
+}
+
+// Full stop-the-world collection, finishes a running cycle first. Sparse heap is compacted right after
+static NativeStatus gc_native(const Value *args, Value *result) {
+  (void)args;
+  force_collection();
+  *result = NIL_VAL;
+  return NATIVE_OK;
+}
+
+// gc_stats("heap"): one number by name, so nothing has to be allocated.
+// Pause times are in microseconds
+static NativeStatus gc_stats_native(const Value *args, Value *result) {
+  if (!IS_STRING(args[0])) return NATIVE_EXPECT_STRING;
+
+  const char *name = AS_CSTRING(args[0]);
+  const GcStats *stats = &vm.gc_stats;
+  double value;
+  if (strcmp(name, "heap") == 0) {
+    value = (double)vm.bytes_allocated;
+  } else if (strcmp(name, "next_gc") == 0) {
+    value = (double)vm.next_gc;
+  } else if (strcmp(name, "minor") == 0) {
+    value = (double)stats->minor_count;
+  } else if (strcmp(name, "major") == 0) {
+    value = (double)stats->major_count;
+  } else if (strcmp(name, "compactions") == 0) {
+    value = (double)stats->compact_count;
+  } else if (strcmp(name, "pages") == 0) {
+    value = (double)vm.heap.page_count;
+  } else if (strcmp(name, "pauses") == 0) {
+    value = (double)stats->pause_count;
+  } else if (strcmp(name, "pause_total") == 0) {
+    value = (double)stats->pause_total_ns / 1000.0;
+  } else if (strcmp(name, "pause_max") == 0) {
+    value = (double)stats->pause_max_ns / 1000.0;
+  } else if (strcmp(name, "p50") == 0) {
+    value = gc_pause_percentile(50);
+  } else if (strcmp(name, "p99") == 0) {
+    value = gc_pause_percentile(99);
+  } else {
+    return NATIVE_UNKNOWN_STAT;
+  }
+
+  *result = NUMBER_VAL(value);
+  return NATIVE_OK;
+}
+
+// string_stats("lookups"): health of the intern table, one number by name like gc_stats().
+// "probe" is groups of 16 slots looked at per lookup, "max_probe" the longest probe of a key
+static NativeStatus string_stats_native(const Value *args, Value *result) {
+  if (!IS_STRING(args[0])) return NATIVE_EXPECT_STRING;
+
+  const char *name = AS_CSTRING(args[0]);
+  const TableStats *stats = &vm.string_stats;
+  double value;
+  if (strcmp(name, "count") == 0) {
+    value = (double)vm.strings.count;
+  } else if (strcmp(name, "capacity") == 0) {
+    value = (double)vm.strings.capacity;
+  } else if (strcmp(name, "tombstones") == 0) {
+    value = (double)vm.strings.tombstones;
+  } else if (strcmp(name, "resizing") == 0) {
+    value = vm.strings.old != NULL ? 1 : 0;
+  } else if (strcmp(name, "lookups") == 0) {
+    value = (double)stats->lookups;
+  } else if (strcmp(name, "hits") == 0) {
+    value = (double)stats->hits;
+  } else if (strcmp(name, "probe") == 0) {
+    value = stats->lookups == 0 ? 0 : (double)stats->groups / (double)stats->lookups;
+  } else if (strcmp(name, "max_probe") == 0) {
+    value = (double)table_max_probe(&vm.strings);
+  } else {
+    return NATIVE_UNKNOWN_STAT;
+  }
+
+  *result = NUMBER_VAL(value);
+  return NATIVE_OK;
+}
+
+const NativeEntry natives[] = {
+  {"clock",        clock_native,        0, false},
+  {"sqrt",         sqrt_native,         1, true},
+  {"gc",           gc_native,           0, false},
+  {"gc_stats",     gc_stats_native,     1, false},
+  {"string_stats", string_stats_native, 1, false},
+};
+
+const int native_count = sizeof(natives) / sizeof(NativeEntry);
+
+const char *native_error(const NativeStatus status) {
+  switch (status) {
+    case NATIVE_OK:            return "No error.";
+    case NATIVE_EXPECT_NUMBER: return "First argument is not a number.";
+    case NATIVE_EXPECT_STRING: return "First argument is not a string.";
+    case NATIVE_UNKNOWN_STAT:  return "Unknown statistic name.";
+  }
+  return "Unknown error.";
+}
\ No newline at end of file
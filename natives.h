@@ -0,0 +1,32 @@
+#ifndef PL_NATIVES_H
+#define PL_NATIVES_H
+
+#include "common.h"
+#include "value.h"
+
+typedef enum {
+  NATIVE_OK,
+  NATIVE_EXPECT_NUMBER,
+  NATIVE_EXPECT_STRING,
+  NATIVE_UNKNOWN_STAT,
+} NativeStatus;
+
+// args point to the first argument on the VM stack, result is the slot of the callee.
+// Writing result is the whole return, nothing is allocated.
+// Arity is already checked by the VM, natives don't need to do it
+typedef NativeStatus (*NativeFn)(const Value *args, Value *result);
+
+typedef struct {
+  const char *name;
+  NativeFn function;
+  int arity;
+  bool pure;  // Same arguments give the same result without side effects, so call can be folded
+} NativeEntry;
+
+// Every native of the language, VM defines them as constant globals in this order
+extern const NativeEntry natives[];
+extern const int native_count;
+
+const char *native_error(NativeStatus status);
+
+#endif // PL_NATIVES_H
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -12,12 +13,11 @@
   (type*)allocate_object(sizeof(type), object_type)
 
 static Obj *allocate_object(const size_t size, const ObjType type) {
-  Obj *object = (Obj*)reallocate(NULL, 0, size);
+  Obj *object = allocate_cell(size);
   object->type = type;
-  object->is_marked = false;
-
-  object->next = vm.objects;
-  vm.objects = object;
+  // Black while a major cycle marks, so it survives the cycle without tracing
+  object->mark = vm.gc_phase == GC_MARK ? vm.mark_epoch : !vm.mark_epoch;
+  object->is_remembered = false;
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -25,10 +25,17 @@ static Obj *allocate_object(const size_t size, const ObjType type) {
   return object;
 }
 
+// New objects are black while a major cycle marks, so the first stores into them need the barrier too
+static void init_barrier(Obj *object, Obj *field) {
+  if (field != NULL) write_barrier(object, OBJ_VAL(field));
+}
+
 ObjActor *new_actor(ObjString *name) {
   ObjActor *actor = ALLOCATE_OBJ(ObjActor, OBJ_ACTOR);
   actor->name = name;
+  actor->field_count = 0;
   init_table(&actor->messages);
+  init_barrier((Obj*)actor, (Obj*)name);
   return actor;
 }
 
@@ -43,6 +50,7 @@ ObjClosure *new_closure(ObjFunction *function) {
   closure->function = function;
   closure->upvalues = upvalues;
   closure->upvalue_count = function->upvalue_count;
+  init_barrier((Obj*)closure, (Obj*)function);
   return closure;
 }
 
@@ -54,23 +62,45 @@ ObjFunction *new_function() {
   return function;
 }
 
+// Fields are stored right after the header, actor already knows how many we need
 ObjInstance *new_instance(ObjActor *actor) {
-  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  const int capacity = actor->field_count;
+  ObjInstance *instance = (ObjInstance*)allocate_object(
+    sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
+
   instance->actor = actor;
-  init_table(&instance->fields);
+  instance->shape = vm.empty_shape;
+  instance->fields = instance->inline_fields;
+  instance->capacity = instance->inline_capacity = capacity;
+  init_barrier((Obj*)instance, (Obj*)actor);
+  init_barrier((Obj*)instance, (Obj*)instance->shape);
   return instance;
 }
 
-ObjNative *new_native(const NativeFn function) {
+ObjNative *new_native(const int index) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
-  native->function = function;
+  native->function = natives[index].function;
+  native->arity = natives[index].arity;
+  native->index = index;
   return native;
 }
 
+ObjShape *new_shape(ObjShape *parent, ObjString *name) {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->slot_count = parent == NULL ? 0 : parent->slot_count + 1;
+  init_table(&shape->transitions);
+  init_barrier((Obj*)shape, (Obj*)parent);
+  init_barrier((Obj*)shape, (Obj*)name);
+  return shape;
+}
+
 // Maybe the shortest hash
 // FNV-1 hash algorithm http://www.isthe.com/chongo/tech/comp/fnv/
-static uint32_t hash_string(const char *key, const int length) {
-  uint32_t hash = 2166136261u;
+// Hash of a string is also the state after its last byte, so concatenation goes on from there.
+// Only for strings shorter than ROPE_MIN_LENGTH, longer concatenations are ropes anyway
+static uint32_t hash_continue(uint32_t hash, const char *key, const int length) {
   for (int i = 0; i < length; ++i) {
     hash ^= (uint8_t)key[i];
     hash *= 16777619;
@@ -78,58 +108,172 @@ static uint32_t hash_string(const char *key, const int length) {
   return hash;
 }
 
-// TODO maybe somewhere in next two functions can be find bug
-ObjString *string_concat(const ObjString *a, const ObjString *b) {
-  const int length = a->length + b->length;
-  char *temp = ALLOCATE(char, length + 1);
-  memcpy(temp, a->chars, a->length);
-  memcpy(temp + a->length, b->chars, b->length);
-  temp[length] = '\0';
-  const uint32_t hash = hash_string(temp, length);
-
-  ObjString *interned = table_find_string(&vm.strings, temp, length, hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, temp, length + 1);
-    return interned;
+// Constants of wyhash https://github.com/wangyi-fudan/wyhash
+#define HASH_SECRET0 0xa0761d6478bd642fULL
+#define HASH_SECRET1 0xe7037ed1a0b428dbULL
+
+// High and low halves of the 128-bit product, xored
+static inline uint64_t hash_mix(const uint64_t a, const uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  const __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+  const uint64_t a_low = (uint32_t)a, a_high = a >> 32;
+  const uint64_t b_low = (uint32_t)b, b_high = b >> 32;
+  const uint64_t low_low = a_low * b_low, high_low = a_high * b_low;
+  const uint64_t low_high = a_low * b_high, high_high = a_high * b_high;
+  const uint64_t middle = (low_low >> 32) + (uint32_t)high_low + low_high;
+  return ((middle << 32) | (uint32_t)low_low) ^ (high_high + (high_low >> 32) + (middle >> 32));
+#endif
+}
+
+static inline uint64_t read_64(const char *chars) {
+  uint64_t word;
+  memcpy(&word, chars, sizeof(word));
+  return word;
+}
+
+// Like wyhash: 16 bytes per multiply instead of one, the last 16 bytes are read
+// again from the end, length is over 16. Table takes both the low and the high bits, so the halves are folded
+static uint32_t hash_long(const char *key, const int length) {
+  uint64_t seed = HASH_SECRET0;
+  int left = length;
+  for (; left > 16; left -= 16, key += 16) {
+    seed = hash_mix(read_64(key) ^ HASH_SECRET1, read_64(key + 8) ^ seed);
   }
+  const uint64_t a = read_64(key + left - 16);
+  const uint64_t b = read_64(key + left - 8);
 
+  const uint64_t hash = hash_mix(HASH_SECRET1 ^ (uint64_t)length, hash_mix(a ^ HASH_SECRET1, b ^ seed));
+  return (uint32_t)hash ^ (uint32_t)(hash >> 32);
+}
+
+// Byte loop costs a multiply per byte. Short strings are most of them and concatenation
+// needs their hash to go on, long ones are flattened ropes and big literals
+static uint32_t hash_string(const char *key, const int length) {
+  if (length >= ROPE_MIN_LENGTH) return hash_long(key, length);
+  return hash_continue(2166136261u, key, length);
+}
+
+// Only after the intern table has missed, caller fills chars
+static ObjString *allocate_string(const int length, const uint32_t hash) {
   ObjString *string = (ObjString*)allocate_object(sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
-  memcpy(string->chars, temp, length);
-  string->chars[length] = '\0';
   string->hash = hash;
+  string->chars[length] = '\0';
+  return string;
+}
 
+static ObjString *intern(ObjString *string) {
   push(OBJ_VAL((Obj*)string));
   table_set(&vm.strings, string, NIL_VAL);
   pop();
-
-  FREE_ARRAY(char, temp, length + 1);
   return string;
 }
 
-ObjString *copy_string(const char *chars, const int length) {
-  ObjString *string = (ObjString*)allocate_object(sizeof(ObjString) + length + 1, OBJ_STRING);
-  string->hash = hash_string(chars, length);
-  ObjString *interned = table_find_string(&vm.strings, chars, length, string->hash);
-
-  if (interned != NULL) {
-    // TODO Maybe need to delete next 2 lines
-    //vm.objects = vm.objects->next;
-    //reallocate(string, sizeof(ObjString) + length + 1, 0);
-    return interned;
+// Both strings must stay reachable, the result is allocated before they are copied.
+// Result is shorter than ROPE_MIN_LENGTH, so its hash goes on from the hash of a
+ObjString *string_concat(const ObjString *a, const ObjString *b) {
+  const int length = a->length + b->length;
+  const uint32_t hash = hash_continue(a->hash, b->chars, b->length);
+
+  ObjString *interned = table_find_concat(&vm.strings, a, b, hash, &vm.string_stats);
+  if (interned != NULL) return interned;
+
+  ObjString *string = allocate_string(length, hash);
+  memcpy(string->chars, a->chars, a->length);
+  memcpy(string->chars + a->length, b->chars, b->length);
+  return intern(string);
+}
+
+static int string_length(const Obj *string) {
+  return string->type == OBJ_STRING ? ((const ObjString*)string)->length : ((const ObjRope*)string)->length;
+}
+
+// Short results are copied and interned at once, longer ones become a rope.
+// a and b are strings or ropes and must stay reachable
+Obj *concatenate_strings(Obj *a, Obj *b) {
+  if (a->type == OBJ_ROPE && ((ObjRope*)a)->flat != NULL) a = (Obj*)((ObjRope*)a)->flat;
+  if (b->type == OBJ_ROPE && ((ObjRope*)b)->flat != NULL) b = (Obj*)((ObjRope*)b)->flat;
+
+  const int length = string_length(a) + string_length(b);
+  if (length < ROPE_MIN_LENGTH && a->type == OBJ_STRING && b->type == OBJ_STRING) {
+    return (Obj*)string_concat((ObjString*)a, (ObjString*)b);
   }
 
-  string->length = length;
-  memcpy(string->chars, chars, length);
-  string->chars[length] = '\0';
+  ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = a;
+  rope->right = b;
+  rope->flat = NULL;
+  write_barrier((Obj*)rope, OBJ_VAL(a));
+  write_barrier((Obj*)rope, OBJ_VAL(b));
+  return (Obj*)rope;
+}
 
-  push(OBJ_VAL((Obj*)string));
-  table_set(&vm.strings, string, NIL_VAL);
+// Right to left with an explicit stack: ropes built in a loop are as deep as the loop.
+// Raw malloc, nothing here may start GC
+static void rope_copy(const ObjRope *rope, char *chars) {
+  int capacity = 8;
+  int count = 0;
+  const Obj **stack = (const Obj**)malloc(sizeof(Obj*) * capacity);
+  if (stack == NULL) exit(1);
+
+  char *end = chars + rope->length;
+  stack[count++] = (const Obj*)rope;
+  while (count > 0) {
+    const Obj *node = stack[--count];
+    if (node->type == OBJ_ROPE && ((const ObjRope*)node)->flat != NULL) {
+      node = (const Obj*)((const ObjRope*)node)->flat;
+    }
+
+    if (node->type == OBJ_STRING) {
+      const ObjString *string = (const ObjString*)node;
+      end -= string->length;
+      memcpy(end, string->chars, string->length);
+      continue;
+    }
+
+    if (capacity < count + 2) {
+      capacity = GROW_CAPACITY(capacity);
+      stack = (const Obj**)realloc(stack, sizeof(Obj*) * capacity);
+      if (stack == NULL) exit(1);
+    }
+    stack[count++] = ((const ObjRope*)node)->left;
+    stack[count++] = ((const ObjRope*)node)->right;
+  }
+  free(stack);
+}
+
+// Only once per rope, the pieces are dropped afterwards
+ObjString *flatten_rope(ObjRope *rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  char *chars = (char*)malloc(rope->length);
+  if (chars == NULL) exit(1);
+  rope_copy(rope, chars);
+
+  push(OBJ_VAL((Obj*)rope));
+  ObjString *string = copy_string(chars, rope->length);
   pop();
+  free(chars);
 
+  rope->flat = string;
+  rope->left = rope->right = NULL;
+  write_barrier((Obj*)rope, OBJ_VAL((Obj*)string));
   return string;
 }
 
+ObjString *copy_string(const char *chars, const int length) {
+  const uint32_t hash = hash_string(chars, length);
+  ObjString *interned = table_find_string(&vm.strings, chars, length, hash, &vm.string_stats);
+  if (interned != NULL) return interned;
+
+  ObjString *string = allocate_string(length, hash);
+  memcpy(string->chars, chars, length);
+  return intern(string);
+}
+
 ObjUpvalue *new_upvalue(Value *slot) {
   ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
@@ -138,6 +282,107 @@ ObjUpvalue *new_upvalue(Value *slot) {
   return upvalue;
 }
 
+// Shapes are short, and inline caches make sure we rarely get here
+int shape_find_slot(const ObjShape *shape, const ObjString *name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name) return shape->slot_count - 1;
+  }
+  return -1;
+}
+
+// NULL means that instance should leave shapes and become a dictionary
+static ObjShape *shape_transition(ObjShape *shape, ObjString *name) {
+  Value next;
+  if (table_get(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+  if (shape->slot_count == SHAPE_MAX_FIELDS ||
+      shape->transitions.count == SHAPE_MAX_TRANSITIONS) {
+    return NULL;
+  }
+
+  ObjShape *child = new_shape(shape, name);
+  push(OBJ_VAL((Obj*)child));
+  table_set(&shape->transitions, name, OBJ_VAL((Obj*)child));
+  write_barrier((Obj*)shape, OBJ_VAL((Obj*)child));
+  pop();
+  return child;
+}
+
+static void ensure_fields_capacity(ObjInstance *instance, const int count) {
+  if (count <= instance->capacity) return;
+
+  int capacity = instance->capacity;
+  while (capacity < count) capacity = GROW_CAPACITY(capacity);
+
+  // Old storage stays in use until the copy is done, so GC sees consistent instance
+  Value *fields = ALLOCATE(Value, capacity);
+  for (int i = 0; i < capacity; ++i) {
+    fields[i] = i < instance->capacity ? instance->fields[i] : NIL_VAL;
+  }
+
+  if (instance->fields != instance->inline_fields) {
+    FREE_ARRAY(Value, instance->fields, instance->capacity);
+  }
+  instance->fields = fields;
+  instance->capacity = capacity;
+}
+
+static void make_dictionary(ObjInstance *instance) {
+  // Slots stay reachable through the shape while the table grows
+  Table *dict = ALLOCATE(Table, 1);
+  init_table(dict);
+  for (const ObjShape *shape = instance->shape; shape->name != NULL; shape = shape->parent) {
+    table_set(dict, shape->name, instance->fields[shape->slot_count - 1]);
+  }
+
+  if (instance->fields != instance->inline_fields) {
+    FREE_ARRAY(Value, instance->fields, instance->capacity);
+  }
+  instance->capacity = instance->inline_capacity;
+  instance->dict = dict;
+  instance->shape = NULL;
+}
+
+bool instance_get_field(const ObjInstance *instance, const ObjString *name, Value *value) {
+  if (instance->shape == NULL) return table_get(instance->dict, name, value);
+
+  const int slot = shape_find_slot(instance->shape, name);
+  if (slot == -1) return false;
+
+  *value = instance->fields[slot];
+  return true;
+}
+
+// Value must be reachable for GC (VM keeps it on the stack)
+int instance_set_field(ObjInstance *instance, ObjString *name, const Value value) {
+  write_barrier((Obj*)instance, value);
+  if (instance->shape != NULL) {
+    const int slot = shape_find_slot(instance->shape, name);
+    if (slot != -1) {
+      instance->fields[slot] = value;
+      return slot;
+    }
+
+    ObjShape *next = shape_transition(instance->shape, name);
+    if (next != NULL) {
+      ensure_fields_capacity(instance, next->slot_count);
+      instance->fields[next->slot_count - 1] = value;
+      instance->shape = next;
+      write_barrier((Obj*)instance, OBJ_VAL((Obj*)next));
+
+      if (instance->actor->field_count < next->slot_count) {
+        instance->actor->field_count = next->slot_count;
+      }
+      return next->slot_count - 1;
+    }
+
+    make_dictionary(instance);
+  }
+
+  table_set(instance->dict, name, value);
+  return -1;
+}
+
 static void print_function(const ObjFunction *function) {
   if (function->name == NULL) {
     printf("<script>");
@@ -163,6 +408,23 @@ void print_object(const Value value) {
     case OBJ_NATIVE:
       printf("<native fn>");
       break;
+    case OBJ_ROPE: {
+      // Printing is no reason to intern the string
+      const ObjRope *rope = AS_ROPE(value);
+      if (rope->flat != NULL) {
+        printf("%s", rope->flat->chars);
+        break;
+      }
+      char *chars = (char*)malloc(rope->length);
+      if (chars == NULL) exit(1);
+      rope_copy(rope, chars);
+      fwrite(chars, 1, rope->length, stdout);
+      free(chars);
+      break;
+    }
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "natives.h"
 #include "table.h"
 #include "value.h"
 
@@ -13,14 +14,19 @@
 #define IS_FUNCTION(value)      is_obj_type(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      is_obj_type(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)        is_obj_type(value, OBJ_NATIVE)
+#define IS_ROPE(value)          is_obj_type(value, OBJ_ROPE)
+#define IS_SHAPE(value)         is_obj_type(value, OBJ_SHAPE)
 #define IS_STRING(value)        is_obj_type(value, OBJ_STRING)
+#define IS_ANY_STRING(value)    (IS_STRING(value) || IS_ROPE(value))  // What user calls a string
 
 #define AS_ACTOR(value)         ((ObjActor*)AS_OBJ(value))
 #define AS_CLOSURE(value)       ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
-#define AS_NATIVE(value)        (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value)        ((ObjNative*)AS_OBJ(value))
+#define AS_ROPE(value)          ((ObjRope*)AS_OBJ(value))
+#define AS_SHAPE(value)         ((ObjShape*)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
 
 typedef enum {
@@ -29,16 +35,21 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_ROPE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE,
 } ObjType;
 
 // Use intrusive list here.
 // This is similar to linked list, but not an add-on
+// Marked if mark == vm.mark_epoch, outside of GC that means old generation.
+// See IS_MARKED in memory.h and collect_nursery()
 struct Obj {
   ObjType type;
-  bool is_marked;
-  Obj *next;
+  bool mark;
+  bool is_remembered;  // Old object in vm.remembered, has young references
+  Obj *next;           // Free cells and big objects, see heap.h
 };
 
 // First class function, so need to be an object
@@ -50,11 +61,11 @@ typedef struct {
   ObjString *name;
 } ObjFunction;
 
-typedef Value* (*NativeFn)(int arg_count, Value *args);
-
 typedef struct {
   Obj obj;
   NativeFn function;
+  int arity;
+  int index;  // In natives[] registry
 } ObjNative;
 
 // Here, we can safely cast ObjString* or ObjFunction* to Obj*
@@ -69,6 +80,18 @@ struct ObjString {
   char chars[];
 };
 
+// Result of a long concatenation. Copying, hashing and interning wait for
+// flatten_rope(), so a string built by + in a loop costs linear time
+#define ROPE_MIN_LENGTH 64  // Shorter concatenations are copied right away
+
+typedef struct {
+  Obj obj;
+  int length;
+  Obj *left;        // ObjString or ObjRope, NULL once flattened
+  Obj *right;
+  ObjString *flat;  // Set by the first flatten_rope()
+} ObjRope;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value *location;
@@ -83,29 +106,59 @@ typedef struct {
   int upvalue_count; // has it in ObjFunction, but need also here for GC (Garbage Collector)
 } ObjClosure;
 
+// Bigger instances and instances with unusual field sets go to dictionary mode
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_MAX_TRANSITIONS 32
+
+// Hidden class. Instances that got the same fields in the same order share one shape,
+// and shape tells at which slot every field lives.
+// Shapes form a tree: every child adds one field to its parent
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape *parent;
+  ObjString *name;    // Field added by transition from parent, NULL for the root
+  int slot_count;     // Fields in this shape, last one lives at slot_count - 1
+  Table transitions;  // Field name -> child shape
+} ObjShape;
+
 typedef struct {
   Obj obj;
   ObjString *name;
   Table messages;
+  int field_count;  // Fields of the biggest instance so far, size of inline storage
 } ObjActor;
 
 typedef struct {
   Obj obj;
   ObjActor *actor;
-  Table fields;
+  ObjShape *shape;   // NULL in dictionary mode
+  union {
+    Value *fields;   // inline_fields, or heap array if instance outgrew it
+    Table *dict;     // Dictionary mode
+  };
+  int capacity;
+  int inline_capacity;
+  Value inline_fields[];
 } ObjInstance;
 
 ObjActor *new_actor(ObjString *name);
 ObjClosure *new_closure(ObjFunction *function);
 ObjFunction *new_function();
 ObjInstance *new_instance(ObjActor *actor);
-ObjNative *new_native(NativeFn function);
+ObjNative *new_native(int index);
+ObjShape *new_shape(ObjShape *parent, ObjString *name);
 ObjString *string_concat(const ObjString *a, const ObjString *b);
+Obj *concatenate_strings(Obj *a, Obj *b);
+ObjString *flatten_rope(ObjRope *rope);
 
 ObjString *copy_string(const char *chars, int length);
 ObjUpvalue *new_upvalue(Value *slot);
 void print_object(Value value);
 
+int shape_find_slot(const ObjShape *shape, const ObjString *name); // -1 if not found
+bool instance_get_field(const ObjInstance *instance, const ObjString *name, Value *value);
+int instance_set_field(ObjInstance *instance, ObjString *name, Value value); // slot or -1 in dictionary mode
+
 static inline bool is_obj_type(const Value value, const ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
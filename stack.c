@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "stack.h"
+
+sigjmp_buf stack_overflow;
+volatile sig_atomic_t stack_guard_armed = false;
+
+static char *guard_begin = NULL;
+static char *guard_end = NULL;
+static struct sigaction previous_action;
+
+static size_t page_size() {
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static size_t stack_bytes(const size_t slots) {
+  const size_t page = page_size();
+  return (slots * sizeof(Value) + page - 1) / page * page;
+}
+
+static void segv_handler(const int signal, siginfo_t *info, void *context) {
+  (void)signal;
+  (void)context;
+  const char *address = info->si_addr;
+  if (stack_guard_armed && address >= guard_begin && address < guard_end) {
+    stack_guard_armed = false;
+    siglongjmp(stack_overflow, 1);
+  }
+
+  // Not our fault (pun intended). Put the old handler back, the instruction faults again
+  sigaction(SIGSEGV, &previous_action, NULL);
+}
+
+Value *reserve_stack(const size_t slots) {
+  const size_t size = stack_bytes(slots);
+  const size_t page = page_size();
+
+  // NORESERVE: nothing is committed until the stack really gets that deep
+  char *memory = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED) {
+    fprintf(stderr, "Could not reserve the value stack.\n");
+    exit(1);
+  }
+
+  guard_begin = memory + size;
+  guard_end = guard_begin + page;
+  if (mprotect(guard_begin, page, PROT_NONE) != 0) {
+    fprintf(stderr, "Could not protect the value stack.\n");
+    exit(1);
+  }
+
+  struct sigaction action;
+  action.sa_sigaction = segv_handler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &previous_action);
+
+  return (Value*)memory;
+}
+
+void release_stack(Value *stack, const size_t slots) {
+  sigaction(SIGSEGV, &previous_action, NULL);
+  munmap(stack, stack_bytes(slots) + page_size());
+  guard_begin = guard_end = NULL;
+}
\ No newline at end of file
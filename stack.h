@@ -0,0 +1,21 @@
+#ifndef PL_STACK_H
+#define PL_STACK_H
+
+#include <setjmp.h>
+#include <signal.h>
+
+#include "value.h"
+
+// Value stack is one reserved range of virtual memory, the OS commits pages on first touch.
+// Guard page right after the end turns an overflow into SIGSEGV, so push has no bounds check
+#define STACK_SLOTS (1 << 24)
+#define STACK_CALL_ROOM 1024  // Free slots call() leaves for a new frame
+
+// Handler jumps here when a push lands on the guard page, only while armed
+extern sigjmp_buf stack_overflow;
+extern volatile sig_atomic_t stack_guard_armed;
+
+Value *reserve_stack(size_t slots);
+void release_stack(Value *stack, size_t slots);
+
+#endif // PL_STACK_H
\ No newline at end of file
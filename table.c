@@ -1,140 +1,488 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// Full group of slots is looked at with a couple of instructions, so the table
+// can be filled further than with linear probing
+#define TABLE_MAX_LOAD 0.875
+// Sparser table is shrunk by the next insert, only deletes make it so
+#define TABLE_MIN_LOAD 0.125
+#define TABLE_GROUP_WIDTH 16
+// Actors have a few messages and shapes a few transitions. Up to this many keys
+// comparing every key pointer is faster than hashing, and there are no control bytes
+#define TABLE_SMALL_MAX 8
+// Smaller tables are rehashed at once, bigger ones a few slots per insert
+#define TABLE_INCREMENTAL_MIN 4096
+
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)  // Tombstone: lookups go on past it
+
+// Low 7 bits of the hash go to the control byte, the rest picks the first group
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7F))
+
+// Bit i of a mask stands for slot i of the group
+#ifdef __SSE2__
+static inline uint32_t match_byte(const uint8_t *group, const uint8_t byte) {
+  const __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+}
+
+// Empty and deleted are the only control bytes with the high bit set
+static inline uint32_t match_free(const uint8_t *group) {
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static inline uint32_t match_byte(const uint8_t *group, const uint8_t byte) {
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; ++i) {
+    mask |= (uint32_t)(group[i] == byte) << i;
+  }
+  return mask;
+}
+
+static inline uint32_t match_free(const uint8_t *group) {
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; ++i) {
+    mask |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return mask;
+}
+#endif
+
+static inline int lowest_bit(const uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+  while ((mask >> bit & 1) == 0) ++bit;
+  return bit;
+#endif
+}
+
+// Groups are visited at triangular steps: 1, 2, 3... groups further.
+// With a power of two number of groups that reaches every group once
+#define FOR_EACH_GROUP(table, hash, group) \
+  for (size_t group_mask_ = (size_t)(table)->capacity / TABLE_GROUP_WIDTH - 1, \
+       group = H1(hash) & group_mask_, step_ = 0; ; \
+       group = (group + ++step_) & group_mask_)
+
+static inline bool is_small(const Table *table) {
+  return table->capacity <= TABLE_SMALL_MAX;
+}
+
+static size_t table_bytes(const int capacity) {
+  return (size_t)capacity * (sizeof(uint8_t) + sizeof(Entry));
+}
 
 void init_table(Table *table) {
-  table->count = table->capacity = 0;
+  table->count = table->tombstones = table->capacity = table->moved = 0;
+  table->ctrl = NULL;
   table->entries = NULL;
+  table->old = NULL;
+}
+
+// Control bytes and entries are one block, entries right after the last control byte
+static void free_slots(Table *table) {
+  if (is_small(table)) {
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+  } else {
+    FREE_ARRAY(uint8_t, table->ctrl, table_bytes(table->capacity));
+  }
 }
 
 void free_table(Table *table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  if (table->old != NULL) {
+    free_slots(table->old);
+    FREE(Table, table->old);
+  }
+  free_slots(table);
   init_table(table);
 }
 
-static Entry *find_entry(Entry *entries, const int capacity, const ObjString *key) {
-  uint32_t index = key->hash % capacity;
-  Entry *tombstone = NULL;
-
-  for (;;) {
-    Entry *entry = &entries[index];
-    if (entry->key == NULL) {
-      // Empty entry
-      if (IS_NIL(entry->value)) return tombstone != NULL ? tombstone : entry;
-      if (tombstone == NULL) tombstone = entry;
-    } else if (entry->key == key) { // Can compare two objects, due to string interning
-      return entry;
+// Slots of this table only, not those in table->old.
+// There is always an empty slot, the load factor is below 1
+static Entry *find_entry(const Table *table, const ObjString *key) {
+  const uint8_t h2 = H2(key->hash);
+  FOR_EACH_GROUP(table, key->hash, group) {
+    const uint8_t *ctrl = table->ctrl + group * TABLE_GROUP_WIDTH;
+    for (uint32_t match = match_byte(ctrl, h2); match != 0; match &= match - 1) {
+      Entry *entry = &table->entries[group * TABLE_GROUP_WIDTH + lowest_bit(match)];
+      if (entry->key == key) return entry;  // Can compare two objects, due to string interning
     }
-    index = (index + 1) % capacity;
+    if (match_byte(ctrl, CTRL_EMPTY) != 0) return NULL;
+  }
+}
+
+static Entry *find_small(const Table *table, const ObjString *key) {
+  for (int i = 0; i < table->count; ++i) {
+    if (table->entries[i].key == key) return &table->entries[i];
+  }
+  return NULL;
+}
+
+static Entry *lookup(const Table *table, const ObjString *key) {
+  if (is_small(table)) return find_small(table, key);
+
+  Entry *entry = find_entry(table, key);
+  if (entry == NULL && table->old != NULL) entry = find_entry(table->old, key);
+  return entry;
+}
+
+// First empty or deleted slot for a key that is not in the table
+static int find_free_slot(const Table *table, const uint32_t hash) {
+  FOR_EACH_GROUP(table, hash, group) {
+    const uint32_t match = match_free(table->ctrl + group * TABLE_GROUP_WIDTH);
+    if (match != 0) return (int)(group * TABLE_GROUP_WIDTH) + lowest_bit(match);
   }
 }
 
 bool table_get(const Table *table, const ObjString *key, Value *value) {
   if (table->count == 0) return false;
 
-  const Entry *entry = find_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  const Entry *entry = lookup(table, key);
+  if (entry == NULL) return false;
 
   *value = entry->value;
   return true;
 }
 
+// Key is in neither half of the table, count is up to the caller
+static void place_entry(Table *table, ObjString *key, const Value value) {
+  const int slot = find_free_slot(table, key->hash);
+  if (table->ctrl[slot] == CTRL_DELETED) --table->tombstones;
+  table->ctrl[slot] = H2(key->hash);
+  table->entries[slot].key = key;
+  table->entries[slot].value = value;
+}
+
+// Rehashes the next slots of table->old, frees it once all are moved
+static void move_entries(Table *table, const int slots) {
+  Table *old = table->old;
+  const int end = old->capacity - table->moved < slots ? old->capacity : table->moved + slots;
+  for (; table->moved < end; ++table->moved) {
+    Entry *entry = &old->entries[table->moved];
+    if (entry->key == NULL) continue;
+
+    place_entry(table, entry->key, entry->value);
+    // Keys further along the probe may not be moved yet
+    old->ctrl[table->moved] = CTRL_DELETED;
+    entry->key = NULL;
+    entry->value = NIL_VAL;
+    --old->count;
+  }
+
+  if (table->moved == old->capacity) {
+    free_slots(old);
+    FREE(Table, old);
+    table->old = NULL;
+    table->moved = 0;
+  }
+}
+
+// Keys of old count for the load already, so the resize is over before the slots fill up
+static int move_step(const Table *table) {
+  const int room = (int)(table->capacity * TABLE_MAX_LOAD) - table->count - table->tombstones;
+  const int left = table->old->capacity - table->moved;
+  const int step = room > 0 ? left / room + 1 : left;
+  return step < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : step;
+}
+
+// Keys take at most half of the max load after a resize, so a rehashed table
+// does not have to grow again soon
+static int capacity_for(const int count) {
+  int capacity = TABLE_GROUP_WIDTH;
+  while (count > capacity * TABLE_MAX_LOAD / 2) capacity *= 2;
+  return capacity;
+}
+
+// Grows, shrinks or just drops the tombstones. A big table keeps its slots
+// as table->old, table_set() moves them over
 static void adjust_capacity(Table *table, const int capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
-  table->count = 0;
+  if (table->old != NULL) move_entries(table, table->old->capacity);
+
+  // Allocation may run GC, that deletes keys. The table is read after it
+  Table *old = table->capacity >= TABLE_INCREMENTAL_MIN ? ALLOCATE(Table, 1) : NULL;
+  uint8_t *ctrl = ALLOCATE(uint8_t, table_bytes(capacity));
+  Table previous = *table;
 
+  table->ctrl = ctrl;
+  table->entries = (Entry*)(ctrl + capacity);
+  table->capacity = capacity;
+  table->tombstones = 0;
+  memset(table->ctrl, CTRL_EMPTY, capacity);
   for (int i = 0; i < capacity; ++i) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+    table->entries[i].key = NULL;
+    table->entries[i].value = NIL_VAL;
   }
 
-  for (int i = 0; i < table->capacity; ++i) {
-    const Entry *entry = &table->entries[i];
-    if (entry->key == NULL) continue;
+  if (old != NULL) {
+    *old = previous;
+    table->old = old;
+    table->moved = 0;
+    return;
+  }
 
-    Entry *dest = find_entry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
+  // Tombstones are left behind, keys are known to be distinct
+  for (int i = 0; i < previous.capacity; ++i) {
+    const Entry *entry = &previous.entries[i];
+    if (entry->key != NULL) place_entry(table, entry->key, entry->value);
+  }
+  free_slots(&previous);
+}
+
+// Keys stay in the first count entries, so a lookup stops at count
+static bool set_small(Table *table, ObjString *key, const Value value) {
+  Entry *entry = find_small(table, key);
+  if (entry != NULL) {
+    entry->value = value;
+    return false;
+  }
+
+  if (table->count == TABLE_SMALL_MAX) {
+    adjust_capacity(table, TABLE_GROUP_WIDTH);
+    place_entry(table, key, value);
     ++table->count;
+    return true;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-  table->entries = entries;
-  table->capacity = capacity;
+  if (table->count == table->capacity) {
+    const int capacity = table->capacity == 0 ? 2 : table->capacity * 2;
+    table->entries = GROW_ARRAY(Entry, table->entries, table->capacity, capacity);
+    for (int i = table->capacity; i < capacity; ++i) {
+      table->entries[i].key = NULL;
+      table->entries[i].value = NIL_VAL;
+    }
+    table->capacity = capacity;
+  }
+
+  table->entries[table->count].key = key;
+  table->entries[table->count].value = value;
+  ++table->count;
+  return true;
 }
 
 bool table_set(Table *table, ObjString *key, const Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    const int capacity = GROW_CAPACITY(table->capacity);
-    adjust_capacity(table, capacity);
+  if (is_small(table)) return set_small(table, key, value);
+  if (table->old != NULL) move_entries(table, move_step(table));
+
+  if (table->count != 0) {
+    Entry *entry = lookup(table, key);
+    if (entry != NULL) {
+      entry->value = value;
+      return false;
+    }
   }
 
-  Entry *entry = find_entry(table->entries, table->capacity, key);
-  const bool is_new_key = entry->key == NULL;
-  if (is_new_key && IS_NIL(entry->value)) ++table->count;
+  if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+    adjust_capacity(table, capacity_for(table->count));
+  } else if (table->capacity > TABLE_GROUP_WIDTH && table->old == NULL &&
+             table->count < table->capacity * TABLE_MIN_LOAD) {
+    // Keys were deleted, see table_remove_white()
+    adjust_capacity(table, capacity_for(table->count));
+  }
 
-  entry->key = key;
-  entry->value = value;
-  return is_new_key;
+  place_entry(table, key, value);
+  ++table->count;
+  return true;
 }
 
-bool table_delete(const Table *table, const ObjString *key) {
+// Group that still has an empty slot has never been full, so no probe went past it
+// and the slot can be empty again. Otherwise it becomes a tombstone
+static void delete_slot(Table *table, const int slot) {
+  const uint8_t *group = table->ctrl + slot / TABLE_GROUP_WIDTH * TABLE_GROUP_WIDTH;
+  if (match_byte(group, CTRL_EMPTY) != 0) {
+    table->ctrl[slot] = CTRL_EMPTY;
+  } else {
+    table->ctrl[slot] = CTRL_DELETED;
+    ++table->tombstones;
+  }
+  table->entries[slot].key = NULL;
+  table->entries[slot].value = NIL_VAL;
+  --table->count;
+}
+
+// Last key takes the place of the deleted one
+static void delete_small(Table *table, const int slot) {
+  Entry *last = &table->entries[--table->count];
+  table->entries[slot] = *last;
+  last->key = NULL;
+  last->value = NIL_VAL;
+}
+
+bool table_delete(Table *table, const ObjString *key) {
   if (table->count == 0) return false;
+  if (is_small(table)) {
+    const Entry *entry = find_small(table, key);
+    if (entry == NULL) return false;
+
+    delete_small(table, (int)(entry - table->entries));
+    return true;
+  }
+
+  const Entry *entry = find_entry(table, key);
+  if (entry != NULL) {
+    delete_slot(table, (int)(entry - table->entries));
+    return true;
+  }
 
-  Entry *entry = find_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  if (table->old == NULL) return false;
+  entry = find_entry(table->old, key);
+  if (entry == NULL) return false;
 
-  // Place a tombstone in the entry :D
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  delete_slot(table->old, (int)(entry - table->old->entries));
+  --table->count;
   return true;
 }
 
 // Required for inheriting methods
 void table_add_all(const Table *from, Table *to) {
-  for (int i = 0; i < from->capacity; ++i) {
-    const Entry *entry = &from->entries[i];
-    if (entry->key != NULL) {
-      table_set(to, entry->key, entry->value);
+  for (const Table *part = from; part != NULL; part = part->old) {
+    for (int i = 0; i < part->capacity; ++i) {
+      const Entry *entry = &part->entries[i];
+      if (entry->key != NULL) {
+        table_set(to, entry->key, entry->value);
+      }
+    }
+  }
+}
+
+static ObjString *find_string(const Table *table, const char *chars, const int length,
+                              const uint32_t hash, TableStats *stats) {
+  if (is_small(table)) {
+    ++stats->groups;
+    for (int i = 0; i < table->count; ++i) {
+      ObjString *key = table->entries[i].key;
+      if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
+    }
+    return NULL;
+  }
+
+  const uint8_t h2 = H2(hash);
+  FOR_EACH_GROUP(table, hash, group) {
+    ++stats->groups;
+    const uint8_t *ctrl = table->ctrl + group * TABLE_GROUP_WIDTH;
+    for (uint32_t match = match_byte(ctrl, h2); match != 0; match &= match - 1) {
+      ObjString *key = table->entries[group * TABLE_GROUP_WIDTH + lowest_bit(match)].key;
+      if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
     }
+    if (match_byte(ctrl, CTRL_EMPTY) != 0) return NULL;
   }
 }
 
-ObjString *table_find_string(const Table *table, const char *chars, const int length, const uint32_t hash) {
+ObjString *table_find_string(const Table *table, const char *chars, const int length,
+                             const uint32_t hash, TableStats *stats) {
+  ++stats->lookups;
   if (table->count == 0) return NULL;
 
-  uint32_t index = hash % table->capacity;
-  for (;;) {
-    const Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length &&
-        entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
+  ObjString *key = find_string(table, chars, length, hash, stats);
+  if (key == NULL && table->old != NULL) key = find_string(table->old, chars, length, hash, stats);
+  if (key != NULL) ++stats->hits;
+  return key;
+}
+
+static bool is_concat(const ObjString *key, const ObjString *a, const ObjString *b,
+                      const uint32_t hash) {
+  return key->length == a->length + b->length && key->hash == hash &&
+         memcmp(key->chars, a->chars, a->length) == 0 &&
+         memcmp(key->chars + a->length, b->chars, b->length) == 0;
+}
+
+static ObjString *find_concat(const Table *table, const ObjString *a, const ObjString *b,
+                              const uint32_t hash, TableStats *stats) {
+  if (is_small(table)) {
+    ++stats->groups;
+    for (int i = 0; i < table->count; ++i) {
+      if (is_concat(table->entries[i].key, a, b, hash)) return table->entries[i].key;
+    }
+    return NULL;
+  }
+
+  const uint8_t h2 = H2(hash);
+  FOR_EACH_GROUP(table, hash, group) {
+    ++stats->groups;
+    const uint8_t *ctrl = table->ctrl + group * TABLE_GROUP_WIDTH;
+    for (uint32_t match = match_byte(ctrl, h2); match != 0; match &= match - 1) {
+      ObjString *key = table->entries[group * TABLE_GROUP_WIDTH + lowest_bit(match)].key;
+      if (is_concat(key, a, b, hash)) return key;
     }
-    index = (index + 1) % table->capacity;
+    if (match_byte(ctrl, CTRL_EMPTY) != 0) return NULL;
   }
 }
 
+// Like table_find_string() for a + b, without building the string
+ObjString *table_find_concat(const Table *table, const ObjString *a, const ObjString *b,
+                             const uint32_t hash, TableStats *stats) {
+  ++stats->lookups;
+  if (table->count == 0) return NULL;
+
+  ObjString *key = find_concat(table, a, b, hash, stats);
+  if (key == NULL && table->old != NULL) key = find_concat(table->old, a, b, hash, stats);
+  if (key != NULL) ++stats->hits;
+  return key;
+}
+
+// Longest probe of a key in groups, 1 when every key is in its first group
+int table_max_probe(const Table *table) {
+  if (is_small(table)) return table->count > 0;
+
+  int longest = 0;
+  for (const Table *part = table; part != NULL; part = part->old) {
+    for (int i = 0; i < part->capacity; ++i) {
+      if (part->entries[i].key == NULL) continue;
+
+      int probe = 0;
+      FOR_EACH_GROUP(part, part->entries[i].key->hash, group) {
+        ++probe;
+        if (group == (size_t)i / TABLE_GROUP_WIDTH) break;
+      }
+      if (probe > longest) longest = probe;
+    }
+  }
+  return longest;
+}
+
 void mark_table(Table *table) {
-  for (int i = 0; i < table->capacity; ++i) {
-    Entry *entry = &table->entries[i];
-    mark_object((Obj*)entry->key);
-    mark_value(entry->value);
+  for (Table *part = table; part != NULL; part = part->old) {
+    for (int i = 0; i < part->capacity; ++i) {
+      Entry *entry = &part->entries[i];
+      mark_object((Obj*)entry->key);
+      mark_value(entry->value);
+    }
   }
 }
 
+// GC must not allocate, so the slots stay. Next table_set() shrinks a table left sparse
 void table_remove_white(Table *table) {
-  for (int i = 0; i < table->capacity; ++i) {
-    Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.is_marked) {
-      table_delete(table, entry->key);
+  if (is_small(table)) {
+    for (int i = 0; i < table->count;) {
+      if (IS_MARKED(&table->entries[i].key->obj)) {
+        ++i;
+      } else {
+        delete_small(table, i);
+      }
+    }
+    return;
+  }
+
+  for (Table *part = table; part != NULL; part = part->old) {
+    for (int i = 0; i < part->capacity; ++i) {
+      const Entry *entry = &part->entries[i];
+      if (entry->key != NULL && !IS_MARKED(&entry->key->obj)) {
+        delete_slot(part, i);
+        if (part != table) --table->count;
+      }
     }
   }
 }
\ No newline at end of file
@@ -9,19 +9,39 @@ typedef struct {
   Value value;
 } Entry;
 
-typedef struct {
-  int count;
-  int capacity;
+// Swiss table: open addressing with one control byte per slot, probed 16 slots at a time.
+// Small one is just the first count entries, found by comparing key pointers.
+// Empty and deleted slots have a NULL key, so entries can be walked without the control bytes.
+// Big tables are rehashed a few slots per insert: until that is over the keys not moved
+// yet stay in old, and walkers go over table, then table->old
+typedef struct Table {
+  int count;          // Keys, those still in old too
+  int tombstones;     // Deleted slots, they count for the load factor like keys
+  int capacity;       // Up to TABLE_SMALL_MAX when small, otherwise power of two from 16
+  int moved;          // Slots of old rehashed so far
+  uint8_t *ctrl;      // Per slot: CTRL_EMPTY, CTRL_DELETED or 7 bits of the key hash. NULL when small
   Entry *entries;
+  struct Table *old;  // Previous slots while a resize goes on, NULL otherwise
 } Table;
 
+// Lookups by contents, that is interning. Only table_find_string() and table_find_concat() count
+typedef struct {
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t groups;  // Groups probed, both halves of a running resize included
+} TableStats;
+
 void init_table(Table *table);
 void free_table(Table *table);
 bool table_get(const Table *table, const ObjString *key, Value *value);
 bool table_set(Table *table, ObjString *key, Value value);
-bool table_delete(const Table *table, const ObjString *key);
+bool table_delete(Table *table, const ObjString *key);
 void table_add_all(const Table *from, Table *to);
-ObjString *table_find_string(const Table *table, const char *chars, int length, uint32_t hash);
+ObjString *table_find_string(const Table *table, const char *chars, int length, uint32_t hash,
+                             TableStats *stats);
+ObjString *table_find_concat(const Table *table, const ObjString *a, const ObjString *b,
+                             uint32_t hash, TableStats *stats);
+int table_max_probe(const Table *table);
 void mark_table(Table *table);
 
 void table_remove_white(Table *table);
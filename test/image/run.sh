@@ -0,0 +1,25 @@
+#!/bin/sh
+# Saves the image of prelude.nz, runs uses_prelude.nz against it and compares the output
+# with its "// expect:" comments. A cut image must stop with exit code 65.
+# Usage: test/image/run.sh path/to/NeZnayu
+set -e
+
+bin=$1
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+"$bin" --save-image "$tmp/prelude.image" "$dir/prelude.nz" > /dev/null
+"$bin" --image "$tmp/prelude.image" "$dir/uses_prelude.nz" > "$tmp/output"
+awk -F '// expect: ' 'NF > 1 { print $2 }' "$dir/uses_prelude.nz" > "$tmp/expected"
+diff "$tmp/expected" "$tmp/output"
+
+size=$(wc -c < "$tmp/prelude.image")
+head -c $((size / 2)) "$tmp/prelude.image" > "$tmp/damaged.image"
+status=0
+"$bin" --image "$tmp/damaged.image" "$dir/uses_prelude.nz" > /dev/null 2> "$tmp/error" || status=$?
+if [ "$status" -ne 65 ]; then
+  echo "Damaged image: exit code $status, expected 65."
+  exit 1
+fi
+grep -q "is damaged" "$tmp/error"
\ No newline at end of file
@@ -29,6 +29,9 @@ def run_tests(directory, test_command):
     results = {}
     for root, _, files in os.walk(directory):
         for file in files:
+            # Drivers like image/run.sh live next to the tests
+            if not file.endswith(".nz"):
+                continue
             file_path = os.path.join(root, file)
             result = subprocess.run(f"{test_command} {file_path}", shell=True, text=True, capture_output=True)
             
@@ -26,6 +26,17 @@ void write_value_array(ValueArray *array, const Value value) {
 }
 
 void print_value(const Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    print_object(value);
+  }
+#else
   switch (value.type) {
     case VAL_BOOL:
       printf(AS_BOOL(value) ? "true" : "false");
@@ -35,9 +46,17 @@ void print_value(const Value value) {
     case VAL_OBJ: print_object(value); break;
     default: return; // Unreachable
   }
+#endif
 }
 
 bool values_equal(const Value a, const Value b) {
+#ifdef NAN_BOXING
+  // NaN != NaN, so numbers can't be compared by bits
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  return a == b;
+#else
   if (a.type != b.type) return false;
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
@@ -46,11 +65,5 @@ bool values_equal(const Value a, const Value b) {
     case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
     default:         return false; // Unreachable
   }
-}
-
-int in_array(const ValueArray *array, const Value value) {
-  for (int i = 0; i < array->length; ++i)
-    if (values_equal(array->values[i], value))
-      return i;
-  return -1;
+#endif
 }
\ No newline at end of file
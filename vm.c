@@ -2,72 +2,30 @@
 #include <stdio.h>
 #include <string.h>
 
-// For native func
-#include <time.h>
-#include <math.h>
-
 #include "common.h"
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "stack.h"
 #include "vm.h"
 
-#ifdef DEBUG_TRACE_EXECUTION
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_PRINT_IC_STATS) || \
+    defined(DEBUG_PROFILE_OPCODES) || defined(DEBUG_PRINT_GC_STATS)
 #include "debug.h"
 #endif
 
 // Can be recoded with pointer variable, which pass from main func
 VM vm;
 
-static void runtime_error(const char *format, ...);
-
-// Native functions
-// TODO
-// 1. Move to separate file
-// 2. Add input stream with (scanf for example)
-// 3. Add input/output streams (with files)
-static Value *clock_native(const int arg_count, Value *args) {
-  if (arg_count != 0) {
-    runtime_error("Expect 0 arguments in clock function but got %d.", arg_count);
-    return NULL;
-  }
-
-  Value *res = NULL;
-  res = (Value*)reallocate(res, 0, sizeof(Value));
-  *res = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
-  return res;
-}
-
-static Value *sqrt_native(const int arg_count, Value *args) {
-  if (arg_count != 1) {
-    runtime_error("Expect 1 argument in sqrt function but got %d.", arg_count);
-    return NULL;
-  }
-
-  // TODO check with actors or funcs
-  if (args[0].type == VAL_OBJ) {
-    runtime_error("First argument is not a number.");
-    return NULL;
-  }
-
-  Value *res = NULL;
-  res = (Value*)reallocate(res, 0, sizeof(Value));
-
-  if (args[0].type == VAL_BOOL) {
-    *res = NUMBER_VAL(sqrt(AS_BOOL(args[0])));
-  } else { // Nil or number
-    *res = NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
-  }
-  return res;
-}
-
-
+// Keep the memory, next interpret() in REPL will need it anyway
 static void clear_stack() {
-  vm.stack_top = vm.stack = FREE_ARRAY(Value, vm.stack, vm.capacity);
-  vm.capacity = vm.frame_count = 0;
+  vm.stack_top = vm.stack;
+  vm.frame_count = 0;
   vm.open_upvalues = NULL;
 }
 
+#define TRACE_EDGE 10  // Frames shown at each end of a long stack trace
+
 static void runtime_error(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -78,6 +36,12 @@ static void runtime_error(const char *format, ...) {
   // Have all stack trace, so use it to show more clear errors!
   // Opposite to python style, first of all exact place of error, then stack trace
   for (int i = vm.frame_count - 1; i >= 0; --i) {
+    // Deep recursion has a million of the same lines, keep both ends only
+    if (i == vm.frame_count - 1 - TRACE_EDGE && i >= TRACE_EDGE) {
+      fprintf(stderr, "... %d more frames\n", i - TRACE_EDGE + 1);
+      i = TRACE_EDGE - 1;
+    }
+
     const CallFrame *frame = &vm.frames[i];
     const ObjFunction *function = frame->closure->function;
     const size_t instruction = frame->ip - function->chunk.code - 1;
@@ -93,9 +57,10 @@ static void runtime_error(const char *format, ...) {
   clear_stack();
 }
 
-static void define_native(const char *name, const NativeFn function) {
+static void define_native(const int index) {
+  const char *name = natives[index].name;
   push(OBJ_VAL((Obj*)copy_string(name, (int)strlen(name))));
-  push(OBJ_VAL((Obj*)new_native(function)));
+  push(OBJ_VAL((Obj*)new_native(index)));
 
   // Buggy one. double free corruption in recursive func :D
   global_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1], true);
@@ -104,51 +69,88 @@ static void define_native(const char *name, const NativeFn function) {
 }
 
 void init_vm() {
+  vm.frames = NULL;
   vm.frame_count = 0;
-  vm.capacity = GROW_CAPACITY(0);
-  vm.stack = NULL;  // To prevent UB from compiler
-  vm.stack_top = vm.stack = GROW_ARRAY(Value, vm.stack, 0, vm.capacity);
+  vm.frame_capacity = 0;
+  vm.frame_limit = FRAMES_MAX;
+  vm.stack_top = vm.stack = reserve_stack(STACK_SLOTS);
 
-  vm.objects = NULL;
+  init_heap(&vm.heap);
   vm.open_upvalues = NULL;
 
+#ifdef REGISTER_OPS
+  vm.register_ops = true;
+#else
+  vm.register_ops = false;
+#endif
+
   vm.bytes_allocated = 0;
-  vm.next_gc = 1024 * 1024; // Some random number. For real language, need to tune better
+  vm.next_gc_step = vm.gc_hard_limit = 0;
+  vm.gc_heap_limit = 0;
+#ifdef DEBUG_STRESS_GC
+  set_gc_mode(GC_STRESS);
+#else
+  set_gc_mode(GC_LATENCY);
+#endif
+  vm.gc_phase = GC_IDLE;
+  vm.gc_paused = false;
+  vm.compact_pending = false;
+  vm.mark_epoch = true;
+  memset(&vm.gc_stats, 0, sizeof(vm.gc_stats));
+
+  vm.remembered_count = 0;
+  vm.remembered_capacity = 0;
+  vm.remembered = NULL;
 
-  vm.gray_count = 0;
-  vm.gray_capacity = 0;
-  vm.gray_stack = NULL;
+  vm.gray.count = vm.gray.capacity = 0;
+  vm.gray.items = NULL;
+  vm.gc_threads = 0;
 
   init_table(&vm.strings);
+  memset(&vm.string_stats, 0, sizeof(vm.string_stats));
+  init_globals(&vm.globals);
 
   // Because during copy_string, GC can be called
   vm.init_string = NULL;
   vm.init_string = copy_string("init", 4);
+  vm.empty_shape = NULL;
+  vm.empty_shape = new_shape(NULL, NULL);
+
+  for (int i = 0; i < native_count; ++i) {
+    define_native(i);
+  }
 
-  define_native("clock", clock_native);
-  define_native("sqrt", sqrt_native);
+#ifdef DEBUG_PROFILE_OPCODES
+  memset(vm.opcode_pairs, 0, sizeof(vm.opcode_pairs));
+  vm.previous_opcode = OP_RETURN;
+#endif
 }
 
 void free_vm() {
+#ifdef DEBUG_PRINT_IC_STATS
+  print_inline_cache_stats();
+#endif
+#ifdef DEBUG_PROFILE_OPCODES
+  print_opcode_profile();
+#endif
+#ifdef DEBUG_PRINT_GC_STATS
+  print_gc_stats();
+#endif
+
   free_table(&vm.strings);
+  free_globals(&vm.globals);
   vm.init_string = NULL;
+  vm.empty_shape = NULL;
   free_objects();
   clear_stack();
+  release_stack(vm.stack, STACK_SLOTS);
+  vm.stack_top = vm.stack = NULL;
+  vm.frames = FREE_ARRAY(CallFrame, vm.frames, vm.frame_capacity);
+  vm.frame_capacity = 0;
 }
 
+// No bounds check, the guard page after the stack catches an overflow
 void push(const Value value) {
-  if (vm.stack_top == vm.stack + vm.capacity) {
-    const int old_capacity = vm.capacity;
-    vm.capacity = GROW_CAPACITY(old_capacity);
-    const Value *stack = vm.stack;
-    vm.stack = GROW_ARRAY(Value, vm.stack, old_capacity, vm.capacity);
-    vm.stack_top = vm.stack + old_capacity;
-
-    // 3 days of debug...
-    for (int i = vm.frame_count - 1; i >= 0; --i) {
-      vm.frames[i].slots = vm.stack + (vm.frames[i].slots - stack);
-    }
-  }
   *vm.stack_top++ = value;
 }
 
@@ -168,17 +170,30 @@ static bool call(ObjClosure *closure, const int arg_count) {
     return false;
   }
 
-  if (vm.frame_count == FRAMES_MAX) {
+  // Caller has stored its ip, so the trace points at this call. Guard page is only
+  // a backstop for a single frame bigger than STACK_CALL_ROOM
+  if (vm.stack_top + STACK_CALL_ROOM > vm.stack + STACK_SLOTS) {
     runtime_error("Stack overflow.");
     return false;
   }
 
+  if (vm.frame_count == vm.frame_capacity) {
+    if (vm.frame_count == vm.frame_limit) {
+      runtime_error("Stack overflow.");
+      return false;
+    }
+
+    // Frames are copied, run() reloads its frame pointer after every call anyway
+    const int old_capacity = vm.frame_capacity;
+    vm.frame_capacity = GROW_CAPACITY(old_capacity);
+    if (vm.frame_capacity > vm.frame_limit) vm.frame_capacity = vm.frame_limit;
+    vm.frames = GROW_ARRAY(CallFrame, vm.frames, old_capacity, vm.frame_capacity);
+  }
+
   // TODO Maybe function for actor call frame
   CallFrame *frame = &vm.frames[vm.frame_count++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-
-  // Maybe bug here, when we expand memory, then we drop vm.stack_top and here we have invalid...
   frame->slots = vm.stack_top - arg_count - 1;
   return true;
 }
@@ -203,13 +218,27 @@ static bool call_value(const Value callee, const int arg_count) {
       case OBJ_CLOSURE:
         return call(AS_CLOSURE(callee), arg_count);
       case OBJ_NATIVE: {
-        const NativeFn native = AS_NATIVE(callee);
-        Value *result = native(arg_count, vm.stack_top - arg_count);
-        if (result == NULL) return false;
+        const ObjNative *native = AS_NATIVE(callee);
+        if (arg_count != native->arity) {
+          runtime_error("Expect %d argument%s in %s function but got %d.", native->arity,
+                        native->arity == 1 ? "" : "s", natives[native->index].name, arg_count);
+          return false;
+        }
 
-        vm.stack_top -= arg_count + 1;
-        push(*result);
-        reallocate(result, sizeof(Value), 0);
+        // Natives see only flat strings, they can't allocate
+        for (Value *arg = vm.stack_top - arg_count; arg < vm.stack_top; ++arg) {
+          if (IS_ROPE(*arg)) *arg = OBJ_VAL((Obj*)flatten_rope(AS_ROPE(*arg)));
+        }
+
+        // Result replaces the callee, arguments are just dropped
+        Value *result = vm.stack_top - arg_count - 1;
+        const NativeStatus status = native->function(result + 1, result);
+        if (status != NATIVE_OK) {
+          runtime_error("%s", native_error(status));
+          return false;
+        }
+
+        vm.stack_top = result + 1;
         return true;
       }
       default:
@@ -221,18 +250,44 @@ static bool call_value(const Value callee, const int arg_count) {
   return false;
 }
 
+// Slow path of the inline cache. Remember the result while there is room,
+// after INLINE_CACHE_SIZE receivers the site is megamorphic and just uses the table
+static void cache_insert(InlineCache *cache, Obj *key, const Value value, const int index) {
+  ++cache->misses;
+  if (cache->count == INLINE_CACHE_SIZE) return;
+
+  CacheEntry *entry = &cache->entries[cache->count++];
+  entry->key = key;
+  entry->value = value;
+  entry->index = index;
+
+  // Caches live in the chunk of the running function
+  Obj *function = (Obj*)vm.frames[vm.frame_count - 1].closure->function;
+  write_barrier(function, OBJ_VAL(key));
+  write_barrier(function, value);
+}
+
 // Combines OP_GET_PROPERTY and OP_CALL
-static bool invoke_from_actor(const ObjActor *actor, const ObjString *name, const int arg_count) {
+static bool invoke_from_actor(ObjActor *actor, const ObjString *name, const int arg_count,
+                              InlineCache *cache) {
+  for (int i = 0; i < cache->count; ++i) {
+    if (cache->entries[i].key == (Obj*)actor) {
+      ++cache->hits;
+      return call(AS_CLOSURE(cache->entries[i].value), arg_count);
+    }
+  }
+
   Value message;
   if (!table_get(&actor->messages, name, &message)) {
     runtime_error("Undefined property '%s'.", name->chars);
     return false;
   }
 
+  cache_insert(cache, (Obj*)actor, message, -1);
   return call(AS_CLOSURE(message), arg_count);
 }
 
-static bool invoke(const ObjString *name, const int arg_count) {
+static bool invoke(const ObjString *name, const int arg_count, InlineCache *cache) {
   const Value receiver = peek(arg_count);
 
   if (!IS_INSTANCE(receiver)) {
@@ -241,7 +296,58 @@ static bool invoke(const ObjString *name, const int arg_count) {
   }
 
   const ObjInstance *instance = AS_INSTANCE(receiver);
-  return invoke_from_actor(instance->actor, name, arg_count);
+  return invoke_from_actor(instance->actor, name, arg_count, cache);
+}
+
+// Caches are keyed by shape: same shape means the field is in the same slot.
+// Instances in dictionary mode have no shape and always take the slow path
+static bool get_field(const ObjInstance *instance, const ObjString *name, InlineCache *cache,
+                      Value *value) {
+  for (int i = 0; i < cache->count; ++i) {
+    const CacheEntry *entry = &cache->entries[i];
+    if (entry->key == (Obj*)instance->shape) {
+      ++cache->hits;
+      *value = instance->fields[entry->index];
+      return true;
+    }
+  }
+
+  if (instance->shape == NULL) {
+    ++cache->misses;
+    return instance_get_field(instance, name, value);
+  }
+
+  const int slot = shape_find_slot(instance->shape, name);
+  if (slot == -1) return false;
+
+  cache_insert(cache, (Obj*)instance->shape, NIL_VAL, slot);
+  *value = instance->fields[slot];
+  return true;
+}
+
+// Entry remembers the shape before the store and the shape after it,
+// which is the same one if the field already exists
+static void set_field(ObjInstance *instance, ObjString *name, const Value value, InlineCache *cache) {
+  for (int i = 0; i < cache->count; ++i) {
+    const CacheEntry *entry = &cache->entries[i];
+    if (entry->key == (Obj*)instance->shape && entry->index < instance->capacity) {
+      ++cache->hits;
+      instance->fields[entry->index] = value;
+      instance->shape = AS_SHAPE(entry->value);
+      write_barrier((Obj*)instance, value);
+      write_barrier((Obj*)instance, entry->value);
+      return;
+    }
+  }
+
+  ObjShape *before = instance->shape;
+  const int slot = instance_set_field(instance, name, value);
+  if (slot == -1) {
+    ++cache->misses;
+    return;
+  }
+
+  cache_insert(cache, (Obj*)before, OBJ_VAL((Obj*)instance->shape), slot);
 }
 
 // TODO can be recoded to more elegant way with pointers
@@ -275,6 +381,7 @@ static void close_upvalues(const Value *last) {
     ObjUpvalue *upvalue = vm.open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    write_barrier((Obj*)upvalue, upvalue->closed);
     vm.open_upvalues = upvalue->next;
   }
 }
@@ -285,6 +392,7 @@ static void define_message(ObjString *name) {
   Value message = peek(0);
   ObjActor *actor = AS_ACTOR(peek(1));
   table_set(&actor->messages, name, message);
+  write_barrier((Obj*)actor, message);
   pop();
 }
 
@@ -292,10 +400,33 @@ static bool is_falsey(const Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Operands stay on the stack until the result exists, GC may run in between
 static void concatenate() {
-  const ObjString *b = AS_STRING(pop());
-  const ObjString *a = AS_STRING(pop());
-  *vm.stack_top++ = OBJ_VAL((Obj*)string_concat(a, b));
+  Obj *result = concatenate_strings(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
+  vm.stack_top -= 2;
+  *vm.stack_top++ = OBJ_VAL(result);
+}
+
+// Strings are interned, so equal ones are the same object. A rope gets flattened
+// (and interned) first, but only when the lengths leave a chance to be equal
+static bool values_equal_slow(const Value a, const Value b) {
+  if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b)) return false;
+
+  const int a_length = IS_ROPE(a) ? AS_ROPE(a)->length : AS_STRING(a)->length;
+  const int b_length = IS_ROPE(b) ? AS_ROPE(b)->length : AS_STRING(b)->length;
+  if (a_length != b_length) return false;
+
+  push(a);
+  push(b);
+  const ObjString *a_flat = IS_ROPE(a) ? flatten_rope(AS_ROPE(a)) : AS_STRING(a);
+  const ObjString *b_flat = IS_ROPE(b) ? flatten_rope(AS_ROPE(b)) : AS_STRING(b);
+  pop();
+  pop();
+  return a_flat == b_flat;
+}
+
+static bool equal(const Value a, const Value b) {
+  return values_equal(a, b) || ((IS_ROPE(a) || IS_ROPE(b)) && values_equal_slow(a, b));
 }
 
 void negate() {
@@ -308,266 +439,647 @@ void negate() {
 // Because it's heart of the VM
 static InterpretResult run() {
   CallFrame *frame = &vm.frames[vm.frame_count - 1];
-#define READ_WORD() (*frame->ip++)
-#define READ_INT() (frame->ip += 2, (uint32_t)((frame->ip[-2] << 16) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_WORD()])
+
+  // Hot state lives in locals, so the C compiler can keep it in registers.
+  // frame->ip is only written back when someone else needs it: calls, returns and errors
+  register uint16_t *ip = frame->ip;
+  register Value *slots = frame->slots;
+  register Value *constants = frame->closure->function->chunk.constants.values;
+
+#define READ_WORD() (*ip++)
+#define READ_INT() (ip += 2, (uint32_t)((ip[-2] << 16) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_WORD()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
+  do { \
+    frame = &vm.frames[vm.frame_count - 1]; \
+    ip = frame->ip; \
+    slots = frame->slots; \
+    constants = frame->closure->function->chunk.constants.values; \
+  } while (false)
+
+// value must not touch the stack itself, its evaluation isn't ordered with the increment
+#define PUSH(value) (*vm.stack_top++ = (value))
+
+#define RUNTIME_ERROR(...) \
+  do { \
+    STORE_FRAME(); \
+    runtime_error(__VA_ARGS__); \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+
 #define BINARY_OP(ValueType, op) \
   do { \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtime_error("Operands must be numbers."); \
-      return INTERPRET_RUNTIME_ERROR; \
+      RUNTIME_ERROR("Operands must be numbers."); \
     } \
     double b = AS_NUMBER(pop()); \
     double a = AS_NUMBER(pop()); \
     *vm.stack_top++ = ValueType(a op b); \
   } while (false)
 
-  // First instruction is opcode, so we do 'decoding/dispatching' the instruction
-  for (;;) {
+// Register ops: operands come from the frame or constants, result goes to a slot or the stack
+#define RK(operand) \
+  (((operand) & RK_CONSTANT) ? constants[(operand) & ~RK_CONSTANT] : slots[operand])
+#define STORE_RK(dst, value) \
+  do { \
+    if ((dst) == RK_PUSH) { \
+      PUSH(value); \
+    } else { \
+      slots[dst] = (value); \
+    } \
+  } while (false)
+
+#define REGISTER_OP(ValueType, op) \
+  do { \
+    const uint16_t dst = READ_WORD(); \
+    const uint16_t left = READ_WORD(); \
+    const uint16_t right = READ_WORD(); \
+    const Value a = RK(left); \
+    const Value b = RK(right); \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+      RUNTIME_ERROR("Operands must be numbers."); \
+    } \
+    STORE_RK(dst, ValueType(AS_NUMBER(a) op AS_NUMBER(b))); \
+  } while (false)
+
 #ifdef DEBUG_TRACE_EXECUTION
-  printf("          ");
-  for (const Value *slot = vm.stack; slot < vm.stack_top; ++slot) {
-    printf("[ ");
-    print_value(*slot);
-    printf(" ]");
-  }
-  printf("\n");
-  disassemble_instruction(&frame->closure->function->chunk,
-    (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+  do { \
+    printf("          "); \
+    for (const Value *slot = vm.stack; slot < vm.stack_top; ++slot) { \
+      printf("[ "); \
+      print_value(*slot); \
+      printf(" ]"); \
+    } \
+    printf("\n"); \
+    disassemble_instruction(&frame->closure->function->chunk, \
+      (int)(ip - frame->closure->function->chunk.code)); \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
 
-    uint16_t instruction;
-    switch (instruction = READ_WORD()) {
-      case OP_CONSTANT: {
-        const Value constant = READ_CONSTANT();
-        push(constant);
-        break;
-      }
-      case OP_NIL:   push(NIL_VAL); break;
-      case OP_TRUE:  push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_POP:   pop(); break;
-      case OP_SET_LOCAL: {
-        const uint16_t slot = READ_WORD();
-        frame->slots[slot] = peek(0);
-        break;
-      }
-      case OP_GET_LOCAL: {
-        const uint16_t slot = READ_WORD();
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        const ObjString *name = READ_STRING();
-        uint16_t ind; // plug
-        const GlobalVar *var = global_find(&vm.globals, name, &ind);
-        if (var == NULL) {
-          runtime_error("Undefined variable '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(var->value);
-        break;
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() \
+  do { \
+    ++vm.opcode_pairs[vm.previous_opcode][instruction]; \
+    vm.previous_opcode = instruction; \
+  } while (false)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+  uint16_t instruction;
+
+#ifdef USE_COMPUTED_GOTO
+  // One label per OpCode from chunk.h. Every handler ends with its own
+  // indirect jump, so the branch predictor learns opcode pairs instead of one shared branch
+  static void *dispatch_table[] = {
+    [OP_CONSTANT]      = &&op_CONSTANT,
+    [OP_NIL]           = &&op_NIL,
+    [OP_TRUE]          = &&op_TRUE,
+    [OP_FALSE]         = &&op_FALSE,
+    [OP_POP]           = &&op_POP,
+    [OP_GET_LOCAL]     = &&op_GET_LOCAL,
+    [OP_SET_LOCAL]     = &&op_SET_LOCAL,
+    [OP_GET_GLOBAL]    = &&op_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL] = &&op_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL]    = &&op_SET_GLOBAL,
+    [OP_GET_GLOBAL_SLOT] = &&op_GET_GLOBAL_SLOT,
+    [OP_SET_GLOBAL_SLOT] = &&op_SET_GLOBAL_SLOT,
+    [OP_GET_UPVALUE]   = &&op_GET_UPVALUE,
+    [OP_SET_UPVALUE]   = &&op_SET_UPVALUE,
+    [OP_GET_PROPERTY]  = &&op_GET_PROPERTY,
+    [OP_SET_PROPERTY]  = &&op_SET_PROPERTY,
+    [OP_EQUAL]         = &&op_EQUAL,
+    [OP_NOT_EQUAL]     = &&op_NOT_EQUAL,
+    [OP_GREATER]       = &&op_GREATER,
+    [OP_GREATER_EQUAL] = &&op_GREATER_EQUAL,
+    [OP_LESS]          = &&op_LESS,
+    [OP_LESS_EQUAL]    = &&op_LESS_EQUAL,
+    [OP_ADD]           = &&op_ADD,
+    [OP_SUBTRACT]      = &&op_SUBTRACT,
+    [OP_MULTIPLY]      = &&op_MULTIPLY,
+    [OP_DIVIDE]        = &&op_DIVIDE,
+    [OP_NOT]           = &&op_NOT,
+    [OP_NEGATE]        = &&op_NEGATE,
+    [OP_PRINT]         = &&op_PRINT,
+    [OP_JUMP]          = &&op_JUMP,
+    [OP_JUMP_IF_FALSE] = &&op_JUMP_IF_FALSE,
+    [OP_LOOP]          = &&op_LOOP,
+    [OP_CALL]          = &&op_CALL,
+    [OP_TAIL_CALL]     = &&op_TAIL_CALL,
+    [OP_INVOKE]        = &&op_INVOKE,
+    [OP_CLOSURE]       = &&op_CLOSURE,
+    [OP_ACTOR]         = &&op_ACTOR,
+    [OP_MESSAGE]       = &&op_MESSAGE,
+    [OP_CLOSE_UPVALUE] = &&op_CLOSE_UPVALUE,
+    [OP_RETURN]        = &&op_RETURN,
+
+    [OP_GET_LOCALS]          = &&op_GET_LOCALS,
+    [OP_GET_LOCAL_PROPERTY]  = &&op_GET_LOCAL_PROPERTY,
+    [OP_SET_LOCAL_POP]       = &&op_SET_LOCAL_POP,
+    [OP_SET_GLOBAL_SLOT_POP] = &&op_SET_GLOBAL_SLOT_POP,
+    [OP_SET_PROPERTY_POP]    = &&op_SET_PROPERTY_POP,
+    [OP_ADD_LOCALS]          = &&op_ADD_LOCALS,
+    [OP_ADD_CONSTANT]        = &&op_ADD_CONSTANT,
+    [OP_SUBTRACT_CONSTANT]   = &&op_SUBTRACT_CONSTANT,
+    [OP_LESS_CONSTANT]       = &&op_LESS_CONSTANT,
+    [OP_JUMP_IF_FALSE_POP]   = &&op_JUMP_IF_FALSE_POP,
+    [OP_RETURN_LOCAL]        = &&op_RETURN_LOCAL,
+
+    [OP_ADD_RK]           = &&op_ADD_RK,
+    [OP_SUBTRACT_RK]      = &&op_SUBTRACT_RK,
+    [OP_MULTIPLY_RK]      = &&op_MULTIPLY_RK,
+    [OP_DIVIDE_RK]        = &&op_DIVIDE_RK,
+    [OP_LESS_RK]          = &&op_LESS_RK,
+    [OP_LESS_EQUAL_RK]    = &&op_LESS_EQUAL_RK,
+    [OP_GREATER_RK]       = &&op_GREATER_RK,
+    [OP_GREATER_EQUAL_RK] = &&op_GREATER_EQUAL_RK,
+    [OP_EQUAL_RK]         = &&op_EQUAL_RK,
+    [OP_NOT_EQUAL_RK]     = &&op_NOT_EQUAL_RK,
+  };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name)     op_##name
+#define DISPATCH() \
+  do { \
+    TRACE_INSTRUCTION(); \
+    instruction = READ_WORD(); \
+    PROFILE_INSTRUCTION(); \
+    goto *dispatch_table[instruction]; \
+  } while (false)
+#else
+  // Portable fallback: one switch, one shared indirect branch
+#define INTERPRET_LOOP \
+  loop: \
+    TRACE_INSTRUCTION(); \
+    instruction = READ_WORD(); \
+    PROFILE_INSTRUCTION(); \
+    switch (instruction)
+#define CASE(name)     case OP_##name
+#define DISPATCH()     goto loop
+#endif
+
+  // First instruction is opcode, so we do 'decoding/dispatching' the instruction
+  INTERPRET_LOOP {
+    CASE(CONSTANT): {
+      PUSH(READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(NIL):   PUSH(NIL_VAL); DISPATCH();
+    CASE(TRUE):  PUSH(BOOL_VAL(true)); DISPATCH();
+    CASE(FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+    CASE(POP):   pop(); DISPATCH();
+    CASE(SET_LOCAL): {
+      const uint16_t slot = READ_WORD();
+      slots[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE(GET_LOCAL): {
+      const uint16_t slot = READ_WORD();
+      PUSH(slots[slot]);
+      DISPATCH();
+    }
+    CASE(GET_GLOBAL): {
+      const ObjString *name = READ_STRING();
+      uint16_t ind; // plug
+      const GlobalVar *var = global_find(&vm.globals, name, &ind);
+      if (var == NULL) {
+        RUNTIME_ERROR("Undefined variable '%s'", name->chars);
       }
-      // Bytecode representation: 5, true, name, where 5 is value, bool is constant or not
-      case OP_DEFINE_GLOBAL: { // 3 bytes opcode: define, string and constant
-        const bool constant = AS_BOOL(pop());
-        const ObjString *name = READ_STRING();
+      PUSH(var->value);
+      DISPATCH();
+    }
+    // Bytecode representation: 5, true, name, where 5 is value, bool is constant or not
+    CASE(DEFINE_GLOBAL): { // 3 bytes opcode: define, string and constant
+      const bool constant = AS_BOOL(pop());
+      ObjString *name = READ_STRING();
+
+      // Warn! Don't pop in set, because of future garbage collector work
+      global_set(&vm.globals, name, peek(0), constant);
+      pop();
+      DISPATCH();
+    }
+    CASE(SET_GLOBAL): {
+      const ObjString *name = READ_STRING();
+      uint16_t ind;
+      const GlobalVar *var = global_find(&vm.globals, name, &ind);
 
-        // Warn! Don't pop in set, because of future garbage collector work
-        global_set(&vm.globals, name, peek(0), constant);
-        pop();
-        break;
+      if (var == NULL) {
+        RUNTIME_ERROR("Undefined variable '%s'", name->chars);
       }
-      case OP_SET_GLOBAL: {
-        const ObjString *name = READ_STRING();
-        uint16_t ind;
-        const GlobalVar *var = global_find(&vm.globals, name, &ind);
+      if (var->constant) {
+        RUNTIME_ERROR("Can't reassign a constant '%s'", name->chars);
+      }
+      global_set_at(&vm.globals, peek(0), ind);
+      DISPATCH();
+    }
+    // Slot was resolved by the compiler, only late binding check is left
+    CASE(GET_GLOBAL_SLOT): {
+      const GlobalVar *var = &vm.globals.values[READ_WORD()];
+      if (!var->defined) {
+        RUNTIME_ERROR("Undefined variable '%s'", var->name->chars);
+      }
+      PUSH(var->value);
+      DISPATCH();
+    }
+    CASE(SET_GLOBAL_SLOT): {
+      const uint16_t ind = READ_WORD();
+      const GlobalVar *var = &vm.globals.values[ind];
 
-        if (var == NULL) {
-          runtime_error("Undefined variable '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        if (var->constant) {
-          runtime_error("Can't reassign a constant '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        global_set_at(&vm.globals, peek(0), ind);
-        break;
-      }
-      case OP_GET_UPVALUE: {
-        const uint16_t slot = READ_WORD();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
-      }
-      // If this slow, then everything is slow
-      case OP_SET_UPVALUE: {
-        const uint16_t slot = READ_WORD();
-        // Closure is indirection above function (maybe, :D)
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
-      }
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtime_error("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      if (!var->defined) {
+        RUNTIME_ERROR("Undefined variable '%s'", var->name->chars);
+      }
+      if (var->constant) {
+        RUNTIME_ERROR("Can't reassign a constant '%s'", var->name->chars);
+      }
+      global_set_at(&vm.globals, peek(0), ind);
+      DISPATCH();
+    }
+    CASE(GET_UPVALUE): {
+      const uint16_t slot = READ_WORD();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    // If this slow, then everything is slow
+    CASE(SET_UPVALUE): {
+      const uint16_t slot = READ_WORD();
+      // Closure is indirection above function (maybe, :D)
+      ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = peek(0);
+      write_barrier((Obj*)upvalue, peek(0));
+      DISPATCH();
+    }
+    CASE(GET_PROPERTY): {
+      if (!IS_INSTANCE(peek(0))) {
+        RUNTIME_ERROR("Only instances have properties.");
+      }
 
-        ObjInstance *instance = AS_INSTANCE(peek(0));
-        ObjString *name = READ_STRING();
+      ObjInstance *instance = AS_INSTANCE(peek(0));
+      ObjString *name = READ_STRING();
+      InlineCache *cache = &frame->closure->function->chunk.caches[READ_WORD()];
 
-        Value value;
-        if (table_get(&instance->fields, name, &value)) {
-          pop(); // Instance
-          push(value);
-        }
-        break;
+      Value value;
+      if (get_field(instance, name, cache, &value)) {
+        pop(); // Instance
+        PUSH(value);
       }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtime_error("Only instances have fields.");
+      DISPATCH();
+    }
+    CASE(SET_PROPERTY): {
+      if (!IS_INSTANCE(peek(1))) {
+        RUNTIME_ERROR("Only instances have fields.");
+      }
+
+      ObjInstance *instance = AS_INSTANCE(peek(1));
+      ObjString *name = READ_STRING();
+      InlineCache *cache = &frame->closure->function->chunk.caches[READ_WORD()];
+
+      set_field(instance, name, peek(0), cache);
+      Value value = pop();
+      pop();
+      PUSH(value);
+      DISPATCH();
+    }
+    CASE(EQUAL): {
+      const Value b = pop();
+      const Value a = pop();
+      *vm.stack_top++ = BOOL_VAL(equal(a, b));
+      DISPATCH();
+    }
+    CASE(NOT_EQUAL): {
+      const Value b = pop();
+      const Value a = pop();
+      *vm.stack_top++ = BOOL_VAL(!equal(a, b));
+      DISPATCH();
+    }
+    CASE(GREATER):       BINARY_OP(BOOL_VAL, >);  DISPATCH();
+    CASE(GREATER_EQUAL): BINARY_OP(BOOL_VAL, >=); DISPATCH();
+    CASE(LESS):          BINARY_OP(BOOL_VAL, <);  DISPATCH();
+    CASE(LESS_EQUAL):    BINARY_OP(BOOL_VAL, <=); DISPATCH();
+    CASE(ADD): {
+      if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+        concatenate();
+      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        const double b = AS_NUMBER(pop());
+        const double a = AS_NUMBER(pop());
+        *vm.stack_top++ = NUMBER_VAL(a + b);
+      } else {
+        RUNTIME_ERROR(
+          "Operands must be two numbers or two strings");
+      }
+      DISPATCH();
+    }
+    CASE(SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+    CASE(MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+    CASE(DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+    CASE(NOT): {
+      const Value value = pop();
+      PUSH(BOOL_VAL(is_falsey(value)));
+      DISPATCH();
+    }
+    CASE(NEGATE):
+      if (!IS_NUMBER(peek(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      negate();
+      DISPATCH();
+    CASE(PRINT): {
+      print_value(pop());
+      printf("\n");
+      DISPATCH();
+    }
+    CASE(JUMP): {
+      const uint32_t offset = READ_INT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(JUMP_IF_FALSE): {
+      const uint32_t offset = READ_INT();
+      if (is_falsey(peek(0))) ip += offset;
+      DISPATCH();
+    }
+    CASE(LOOP): {
+      const uint32_t offset = READ_INT();
+      ip -= offset;
+      // Back edges and calls are the safe points: run() keeps no object pointer in a local
+      if (vm.compact_pending) compact_heap();
+      DISPATCH();
+    }
+    CASE(CALL): {
+      const int arg_count = READ_WORD();
+      STORE_FRAME();
+      if (vm.compact_pending) compact_heap();
+      if (!call_value(peek(arg_count), arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    // Callee takes over the frame: closure and arguments are moved down to its slots.
+    // Anything else is a usual call, and OP_RETURN right after returns its result
+    CASE(TAIL_CALL): {
+      const int arg_count = READ_WORD();
+      const Value callee = peek(arg_count);
+      if (!IS_CLOSURE(callee)) {
+        STORE_FRAME();
+        if (!call_value(callee, arg_count)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        
-        ObjInstance *instance = AS_INSTANCE(peek(1));
-        table_set(&instance->fields, READ_STRING(), peek(0));
-        Value value = pop();
-        pop();
-        push(value);
-        break;
-      }
-      case OP_EQUAL: {
-        const Value b = pop();
-        const Value a = pop();
-        *vm.stack_top++ = BOOL_VAL(values_equal(a, b));
-        break;
-      }
-      case OP_NOT_EQUAL: {
-        const Value b = pop();
-        const Value a = pop();
-        *vm.stack_top++ = BOOL_VAL(!values_equal(a, b));
-        break;
-      }
-      case OP_GREATER:       BINARY_OP(BOOL_VAL, >);  break;
-      case OP_GREATER_EQUAL: BINARY_OP(BOOL_VAL, >=); break;
-      case OP_LESS:          BINARY_OP(BOOL_VAL, <);  break;
-      case OP_LESS_EQUAL:    BINARY_OP(BOOL_VAL, <=); break;
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          const double b = AS_NUMBER(pop());
-          const double a = AS_NUMBER(pop());
-          *vm.stack_top++ = NUMBER_VAL(a + b);
+        LOAD_FRAME();
+        DISPATCH();
+      }
+
+      ObjClosure *closure = AS_CLOSURE(callee);
+      if (arg_count != closure->function->arity) {
+        RUNTIME_ERROR("Expect %d arguments but got %d.", closure->function->arity, arg_count);
+      }
+
+      close_upvalues(slots);
+      memmove(slots, vm.stack_top - arg_count - 1, sizeof(Value) * (arg_count + 1));
+      vm.stack_top = slots + arg_count + 1;
+
+      frame->closure = closure;
+      frame->ip = closure->function->chunk.code;
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(INVOKE): {
+      const ObjString *message = READ_STRING();
+      const int arg_count = READ_WORD();
+      InlineCache *cache = &frame->closure->function->chunk.caches[READ_WORD()];
+      STORE_FRAME();
+      if (!invoke(message, arg_count, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(CLOSURE): {
+      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      ObjClosure *closure = new_closure(function);
+      PUSH(OBJ_VAL((Obj*)closure));
+
+      for (int i = 0; i < closure->upvalue_count; ++i) {
+        const uint16_t is_local = READ_WORD();
+        const uint16_t index = READ_WORD();
+
+        if (is_local) {
+          closure->upvalues[i] = capture_upvalue(slots + index);
         } else {
-          runtime_error(
-            "Operands must be two numbers or two strings");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NOT:
-        push(BOOL_VAL(is_falsey(pop())));
-        break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtime_error("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
-        negate();
-        break;
-      case OP_PRINT: {
-        print_value(pop());
-        printf("\n");
-        break;
-      }
-      case OP_JUMP: {
-        const uint32_t offset = READ_INT();
-        frame->ip += offset;
-        break;
-      }
-      case OP_JUMP_IF_FALSE: {
-        const uint32_t offset = READ_INT();
-        if (is_falsey(peek(0))) frame->ip += offset;
-        break;
-      }
-      case OP_LOOP: {
-        const uint32_t offset = READ_INT();
-        frame->ip -= offset;
-        break;
-      }
-      case OP_CALL: {
-        const int arg_count = READ_WORD();
-        if (!call_value(peek(arg_count), arg_count)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+        // Capturing allocates, so the closure may be old by now
+        write_barrier((Obj*)closure, OBJ_VAL((Obj*)closure->upvalues[i]));
       }
-      case OP_INVOKE: {
-        const ObjString *message = READ_STRING();
-        const int arg_count = READ_WORD();
-        if (!invoke(message, arg_count)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
-      }
-      case OP_CLOSURE: {
-        ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure *closure = new_closure(function);
-        push(OBJ_VAL((Obj*)closure));
-
-        for (int i = 0; i < closure->upvalue_count; ++i) {
-          const uint16_t is_local = READ_WORD();
-          const uint16_t index = READ_WORD();
-
-          if (is_local) {
-            closure->upvalues[i] = capture_upvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
-        }
-        break;
-      }
-      case OP_ACTOR:
-        push(OBJ_VAL((Obj*)new_actor(READ_STRING())));
-        break;
-      case OP_MESSAGE:
-        define_message(READ_STRING());
-        break;
-      case OP_CLOSE_UPVALUE:
-        close_upvalues(vm.stack_top - 1);
+      DISPATCH();
+    }
+    CASE(ACTOR):
+      PUSH(OBJ_VAL((Obj*)new_actor(READ_STRING())));
+      DISPATCH();
+    CASE(MESSAGE):
+      define_message(READ_STRING());
+      DISPATCH();
+    CASE(CLOSE_UPVALUE):
+      close_upvalues(vm.stack_top - 1);
+      pop();
+      DISPATCH();
+    CASE(RETURN_LOCAL):
+      PUSH(slots[READ_WORD()]);
+      // Fall through
+    CASE(RETURN): {
+      const Value result = pop();
+      close_upvalues(slots);
+      if (--vm.frame_count == 0) {
         pop();
-        break;
-      case OP_RETURN: {
-        const Value result = pop();
-        close_upvalues(frame->slots);
-        if (--vm.frame_count == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
+        return INTERPRET_OK;
+      }
+
+      vm.stack_top = slots;
+      push(result);
+      LOAD_FRAME();
+      DISPATCH();
+    }
 
-        vm.stack_top = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+    // Superinstructions. Same checks and errors as the original pairs
+    CASE(GET_LOCALS): {
+      const uint16_t first = READ_WORD();
+      const uint16_t second = READ_WORD();
+      PUSH(slots[first]);
+      PUSH(slots[second]);
+      DISPATCH();
+    }
+    CASE(GET_LOCAL_PROPERTY): {
+      const Value receiver = slots[READ_WORD()];
+      ObjString *name = READ_STRING();
+      InlineCache *cache = &frame->closure->function->chunk.caches[READ_WORD()];
+
+      if (!IS_INSTANCE(receiver)) {
+        RUNTIME_ERROR("Only instances have properties.");
       }
-      default:
-        printf("Command '%d' doesn't exist", instruction);
-        runtime_error("Programming language problem.");
-        return INTERPRET_RUNTIME_ERROR;
+
+      Value value;
+      PUSH(get_field(AS_INSTANCE(receiver), name, cache, &value) ? value : receiver);
+      DISPATCH();
     }
+    CASE(SET_LOCAL_POP):
+      slots[READ_WORD()] = pop();
+      DISPATCH();
+    CASE(SET_GLOBAL_SLOT_POP): {
+      const uint16_t ind = READ_WORD();
+      const GlobalVar *var = &vm.globals.values[ind];
+
+      if (!var->defined) {
+        RUNTIME_ERROR("Undefined variable '%s'", var->name->chars);
+      }
+      if (var->constant) {
+        RUNTIME_ERROR("Can't reassign a constant '%s'", var->name->chars);
+      }
+      global_set_at(&vm.globals, pop(), ind);
+      DISPATCH();
+    }
+    CASE(SET_PROPERTY_POP): {
+      if (!IS_INSTANCE(peek(1))) {
+        RUNTIME_ERROR("Only instances have fields.");
+      }
+
+      ObjInstance *instance = AS_INSTANCE(peek(1));
+      ObjString *name = READ_STRING();
+      InlineCache *cache = &frame->closure->function->chunk.caches[READ_WORD()];
+
+      set_field(instance, name, peek(0), cache);
+      vm.stack_top -= 2;
+      DISPATCH();
+    }
+    CASE(ADD_LOCALS): {
+      const Value a = slots[READ_WORD()];
+      const Value b = slots[READ_WORD()];
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+
+      PUSH(a);
+      PUSH(b);
+      if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b)) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings");
+      }
+      concatenate();
+      DISPATCH();
+    }
+    CASE(ADD_CONSTANT): {
+      const Value b = READ_CONSTANT();
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(b)) {
+        vm.stack_top[-1] = NUMBER_VAL(AS_NUMBER(vm.stack_top[-1]) + AS_NUMBER(b));
+        DISPATCH();
+      }
+
+      PUSH(b);
+      if (!IS_ANY_STRING(peek(0)) || !IS_ANY_STRING(peek(1))) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings");
+      }
+      concatenate();
+      DISPATCH();
+    }
+    CASE(SUBTRACT_CONSTANT): {
+      const Value b = READ_CONSTANT();
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(b)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      vm.stack_top[-1] = NUMBER_VAL(AS_NUMBER(vm.stack_top[-1]) - AS_NUMBER(b));
+      DISPATCH();
+    }
+    CASE(LESS_CONSTANT): {
+      const Value b = READ_CONSTANT();
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(b)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      vm.stack_top[-1] = BOOL_VAL(AS_NUMBER(vm.stack_top[-1]) < AS_NUMBER(b));
+      DISPATCH();
+    }
+    // Pops only when falling through, code at the target pops by itself
+    CASE(JUMP_IF_FALSE_POP): {
+      const uint32_t offset = READ_INT();
+      if (is_falsey(peek(0))) {
+        ip += offset;
+      } else {
+        pop();
+      }
+      DISPATCH();
+    }
+
+    CASE(ADD_RK): {
+      const uint16_t dst = READ_WORD();
+      const uint16_t left = READ_WORD();
+      const uint16_t right = READ_WORD();
+      const Value a = RK(left);
+      const Value b = RK(right);
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        STORE_RK(dst, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+      if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b)) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings");
+      }
+
+      PUSH(a);
+      PUSH(b);
+      concatenate();
+      if (dst != RK_PUSH) slots[dst] = pop();
+      DISPATCH();
+    }
+    CASE(SUBTRACT_RK):      REGISTER_OP(NUMBER_VAL, -);  DISPATCH();
+    CASE(MULTIPLY_RK):      REGISTER_OP(NUMBER_VAL, *);  DISPATCH();
+    CASE(DIVIDE_RK):        REGISTER_OP(NUMBER_VAL, /);  DISPATCH();
+    CASE(LESS_RK):          REGISTER_OP(BOOL_VAL, <);    DISPATCH();
+    CASE(LESS_EQUAL_RK):    REGISTER_OP(BOOL_VAL, <=);   DISPATCH();
+    CASE(GREATER_RK):       REGISTER_OP(BOOL_VAL, >);    DISPATCH();
+    CASE(GREATER_EQUAL_RK): REGISTER_OP(BOOL_VAL, >=);   DISPATCH();
+    CASE(EQUAL_RK): {
+      const uint16_t dst = READ_WORD();
+      const uint16_t left = READ_WORD();
+      const uint16_t right = READ_WORD();
+      STORE_RK(dst, BOOL_VAL(equal(RK(left), RK(right))));
+      DISPATCH();
+    }
+    CASE(NOT_EQUAL_RK): {
+      const uint16_t dst = READ_WORD();
+      const uint16_t left = READ_WORD();
+      const uint16_t right = READ_WORD();
+      STORE_RK(dst, BOOL_VAL(!equal(RK(left), RK(right))));
+      DISPATCH();
+    }
+#ifndef USE_COMPUTED_GOTO
+    default:
+      printf("Command '%d' doesn't exist", instruction);
+      RUNTIME_ERROR("Programming language problem.");
+#endif
   }
 
+  // Unreachable, every handler dispatches or returns
+  return INTERPRET_RUNTIME_ERROR;
+
 #undef READ_WORD
 #undef READ_INT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef RK
+#undef STORE_RK
+#undef REGISTER_OP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char *source) {
@@ -580,5 +1092,18 @@ InterpretResult interpret(const char *source) {
   push(OBJ_VAL((Obj*)closure));
   call(closure, 0);
 
-  return run();
+  // Push onto the guard page ends up here, straight from the SIGSEGV handler
+  if (sigsetjmp(stack_overflow, 1) != 0) {
+    // ip of the running frame was only in run(), its last call is the best we know.
+    // Frame that hasn't called anything yet is dropped, the trace starts at its call
+    const CallFrame *top = &vm.frames[vm.frame_count - 1];
+    if (top->ip == top->closure->function->chunk.code) --vm.frame_count;
+    runtime_error("Stack overflow.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
+  stack_guard_armed = true;
+  const InterpretResult result = run();
+  stack_guard_armed = false;
+  return result;
 }
\ No newline at end of file
@@ -5,8 +5,43 @@
 #include "table.h"
 #include "value.h"
 #include "global_vars.h"
+#include "heap.h"
 
-#define FRAMES_MAX 256
+#define FRAMES_MAX (1 << 20) // Default depth limit, see --max-frames
+
+typedef enum {
+  GC_IDLE,   // Only minor collections
+  GC_MARK,   // Major cycle marks the old generation in slices
+  GC_SWEEP,  // Pages wait for a lazy sweep, minor collections go on
+} GcPhase;
+
+// Collector trade-offs for one run, see set_gc_mode() and --gc-mode
+typedef enum {
+  GC_THROUGHPUT,  // Stop-the-world majors, big nursery, heap grows freely
+  GC_LATENCY,     // Major cycle in slices of vm.gc_budget_ns
+  GC_MEMORY,      // Small heap, collects early and often
+  GC_STRESS,      // Something on every allocation, for finding GC bugs
+} GcMode;
+
+// Worklist of gray objects, one per marker thread
+typedef struct {
+  Obj **items;
+  int count;
+  int capacity;
+} GrayStack;
+
+// Pauses up to 1ms are counted with 1us precision, longer ones with 1ms
+#define GC_PAUSE_BUCKETS 2048
+
+typedef struct {
+  uint64_t minor_count;
+  uint64_t major_count;
+  uint64_t compact_count;
+  uint64_t pause_count;
+  uint64_t pause_total_ns;
+  uint64_t pause_max_ns;
+  uint32_t pauses[GC_PAUSE_BUCKETS];  // Histogram, see record_pause()
+} GcStats;
 
 typedef struct {
   ObjClosure *closure;
@@ -18,11 +53,12 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame *frames;  // Grows on demand up to frame_limit
   int frame_count;
+  int frame_capacity;
+  int frame_limit;
 
-  int capacity;
-  Value *stack;
+  Value *stack;  // STACK_SLOTS reserved, see stack.h
 
   Value *stack_top;
   GlobalVarArray globals;
@@ -30,17 +66,46 @@ typedef struct {
   // For String Interning
   // Make sure that strings with the same chars have the same memory
   Table strings;
-  
+  TableStats string_stats;
+
   ObjString *init_string;  // init keyword for actors
+  ObjShape *empty_shape;   // Root of all shapes, every new instance starts here
+  bool register_ops;       // Compiler emits register ops, see REGISTER_OPS
   ObjUpvalue *open_upvalues;
 
   size_t bytes_allocated;
   size_t next_gc; // some threshold
   
-  Obj *objects;  // head of the list
-  int gray_count;
-  int gray_capacity;
-  Obj **gray_stack;
+  size_t next_minor_gc;
+  size_t next_gc_step;   // Next slice of a major cycle
+  size_t gc_hard_limit;  // Cycle is finished at once if mutator outruns it
+  uint64_t gc_budget_ns; // Longest slice, 0 means stop-the-world major GC
+  GcMode gc_mode;
+  size_t gc_heap_limit;     // Hard ceiling, 0 means none
+  size_t gc_nursery_size;   // Adapted to the survival rate of minor GC
+  size_t gc_minor_base;     // Heap right after the last minor GC
+  double gc_growth;         // Heap after a major cycle times this is the next trigger
+  uint64_t gc_cycle_end_ns;    // Time and pause_total_ns when the last cycle ended,
+  uint64_t gc_cycle_pause_ns;  // growth is tuned by GC share of the time since then
+  GcPhase gc_phase;
+  bool gc_paused;        // Heap image is being saved or loaded, see image.c
+  bool gc_compact;       // Major cycles may ask for compaction, see --gc-compact
+  bool compact_pending;  // run() calls compact_heap() at the next safe point
+  bool mark_epoch;       // Flipped at each major cycle, so old objects turn white at once
+  GcStats gc_stats;
+
+  Heap heap;
+  int remembered_count;
+  int remembered_capacity;
+  Obj **remembered;  // Old objects that may point into the nursery
+
+  GrayStack gray;
+  int gc_threads;  // Markers while the mutator waits, 0 means one per CPU
+
+#ifdef DEBUG_PROFILE_OPCODES
+  uint64_t opcode_pairs[OP_COUNT][OP_COUNT];  // [previous][current]
+  uint16_t previous_opcode;
+#endif
 } VM;
 
 typedef enum {